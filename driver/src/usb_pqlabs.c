@@ -6,9 +6,38 @@
 #include <linux/kref.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
+#include <linux/usb/hcd.h>
+#include <linux/usb/input.h>
+#include <linux/dma-mapping.h>
 #include <linux/mutex.h>
 #include <linux/compat.h>
 #include <linux/version.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
+#include <linux/pm_runtime.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/input.h>
+#include <linux/input/mt.h>
+#include <linux/capability.h>
+#include <linux/workqueue.h>
+
+#include "usb_pqlabs.h"
+
+#define CREATE_TRACE_POINTS
+#include "usb_pqlabs_trace.h"
 
 
 /* Define these values to match your devices */
@@ -19,15 +48,91 @@
 #define USB_PQLABS_INTERFACE_SUBCLASS        0x0
 #define USB_PQLABS_INTERFACE_PROTOCOL        0x0
 
-struct pqlabs_string_descriptor
-{
-  __s32 index;
-  char value[256];
+#define PQLABS_MAX_CONTACTS	16
+/* upper bound for pqlabs_decoder.max_contacts */
+
+/* one contact as a decoder hands it to the input device */
+struct pqlabs_contact {
+	int                     id;			/* stays the same while it is down */
+	bool                    down;			/* false once it was lifted */
+	int                     x;
+	int                     y;
+};
+
+/* turns the transfers of one kind of frame into contacts */
+struct pqlabs_decoder {
+	const char              *key;			/* evdev= selects it by this */
+	const char              *name;			/* of the input device */
+	unsigned int            max_contacts;
+	int                     x_max;
+	int                     y_max;
+	/* returns the number of contacts, or < 0 if data is no touch report */
+	int                     (*decode)(const u8 *data, size_t len,
+					  struct pqlabs_contact *contacts);
 };
 
+/*
+ * the wire format of a real frame is not documented. this is the one
+ * driver/tools/pqlabs_emu sends, see pqlabs_emu.h there: a header and
+ * up to 10 contacts, little endian.
+ */
+#define PQLABS_EMU_TAG		0xA5
+#define PQLABS_EMU_MAX_CONTACTS	10
+#define PQLABS_EMU_AXIS_MAX	32767
+
+struct pqlabs_emu_contact {
+	u8                      id;
+	u8                      down;
+	__le16                  x;
+	__le16                  y;
+} __packed;
+
+struct pqlabs_emu_report {
+	u8                      tag;
+	u8                      contacts;
+	__le16                  counter;
+	__le64                  sent_ns;
+	struct pqlabs_emu_contact contact[];
+} __packed;
+
+static int pqlabs_emu_decode(const u8 *data, size_t len,
+			     struct pqlabs_contact *contacts)
+{
+	const struct pqlabs_emu_report *report = (const void *)data;
+	unsigned int i;
+
+	if (len < sizeof(*report) || report->tag != PQLABS_EMU_TAG ||
+	    report->contacts > PQLABS_EMU_MAX_CONTACTS ||
+	    len < struct_size(report, contact, report->contacts))
+		return -EBADMSG;
+
+	for (i = 0; i < report->contacts; i++) {
+		contacts[i].id = report->contact[i].id;
+		contacts[i].down = report->contact[i].down;
+		contacts[i].x = min_t(int, le16_to_cpu(report->contact[i].x),
+				      PQLABS_EMU_AXIS_MAX);
+		contacts[i].y = min_t(int, le16_to_cpu(report->contact[i].y),
+				      PQLABS_EMU_AXIS_MAX);
+	}
+	return report->contacts;
+}
+
+static const struct pqlabs_decoder pqlabs_emu_decoder = {
+	.key =		"emu",
+	.name =		"PQLabs Multitouch (emulated)",
+	.max_contacts =	PQLABS_EMU_MAX_CONTACTS,
+	.x_max =	PQLABS_EMU_AXIS_MAX,
+	.y_max =	PQLABS_EMU_AXIS_MAX,
+	.decode =	pqlabs_emu_decode,
+};
 
-#define USB_IOCTL_GET_STRING                 _IOR('Q', 0x04, struct pqlabs_string_descriptor)
-#define USB_IOCTL_CLEAR_FEATURE              _IOR('Q', 0x05, int)
+/*
+ * a decoder is only ever picked by name. none of these is the format of
+ * a real frame, so none may be bound to the product ids in pqlabs_table.
+ */
+static const struct pqlabs_decoder *pqlabs_decoders[] = {
+	&pqlabs_emu_decoder,
+};
 
 /* table of devices that work with this driver */
 static struct usb_device_id pqlabs_table[] = {
@@ -59,6 +164,132 @@ MODULE_DEVICE_TABLE(usb, pqlabs_table);
    is an integer 512 is the largest possible packet on EHCI */
 #define WRITES_IN_FLIGHT	8
 /* arbitrarily chosen */
+#define PQLABS_MAX_RX_URBS	16
+/* upper bound for the rx_urbs module parameter */
+#define PQLABS_MAX_RX_SLOTS	256
+/* bounds the size of the ring header and its slot descriptors */
+#define READ_USB_MAX_LENGTH			(64 * 1024)
+#define READ_USB_TIMEOUT			(1000)
+/* default read() timeout in ms, see USB_IOCTL_SET_READ_TIMEOUT */
+
+/* number of bulk-in URBs kept in flight while the device is open */
+static unsigned int rx_urbs = 4;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs, "Number of bulk-in URBs kept in flight (1-16, default 4)");
+
+/* depth of the received transfer FIFO, rounded up to a power of two */
+static unsigned int rx_slots = 8;
+module_param(rx_slots, uint, 0444);
+MODULE_PARM_DESC(rx_slots, "Number of received transfers queued for read() (default 8)");
+
+/* bulk-in transfer size, rounded up to whole packets of the endpoint */
+static unsigned int rx_size;
+module_param(rx_size, uint, 0444);
+MODULE_PARM_DESC(rx_size, "Bytes per bulk-in transfer (0 for the 64 KiB maximum)");
+
+/* runtime pm idle time of the frame, power/autosuspend_delay_ms changes it later */
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay, "Autosuspend delay in ms (-1 keeps the usbcore default)");
+
+/* a virtual device that plays captures back, see usb_pqlabs.h */
+static bool replay;
+module_param(replay, bool, 0444);
+MODULE_PARM_DESC(replay, "Create /dev/pqlabs_replay for playing back captures (default off)");
+
+/* one node merging every device, see usb_pqlabs.h */
+static bool aggregate;
+module_param(aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate, "Create /dev/pqlabs_aggregate merging all frames (default off)");
+
+/* an input device per frame, fed from the completion path */
+static char *evdev;
+module_param(evdev, charp, 0444);
+MODULE_PARM_DESC(evdev, "Decode touches for a multitouch input device: emu for pqlabs_emu (default none)");
+
+struct usb_pqlabs;
+struct pqlabs_file;
+
+/* one received transfer, owned by an URB until ready is set */
+struct pqlabs_rx_slot {
+	unsigned char           *buffer;
+	dma_addr_t              dma;			/* buffer as mapped for the controller */
+	size_t                  filled;			/* bytes received */
+	int                     status;			/* urb status of the transfer */
+	bool                    ready;			/* the transfer has completed */
+	u64                     seq;			/* per-device transfer number */
+	ktime_t                 ts;			/* completion time, CLOCK_MONOTONIC */
+	int                     usb_frame;		/* bus frame number at completion */
+	struct usb_pqlabs       *dev;			/* for pages lent to a pipe */
+};
+
+/* a bulk-in URB and the ring slot it is currently filling */
+struct pqlabs_rx_urb {
+	struct usb_pqlabs       *dev;
+	struct urb              *urb;
+	ktime_t                 submitted;		/* time of the last submission */
+	unsigned long           slot;			/* ring index being filled */
+	bool                    queued;			/* owned by the host controller */
+};
+
+#define PQLABS_HIST_BUCKETS	24
+/* log2 buckets of microseconds, the last one is open ended */
+#define PQLABS_MAX_STRINGS	6
+/* string descriptors cached per device */
+#define PQLABS_MAX_BUSY_POLL	(USEC_PER_SEC / 100)
+/* longest spin allowed in USB_IOCTL_SET_BUSY_POLL, in us */
+#define PQLABS_IDLE_PREV_MAX	256
+/* longer transfers are never taken for duplicates */
+#define PQLABS_TOUCH_HOLD_MS	250
+/* per transfer wakeups for this long after the last touch */
+#define PQLABS_ATTACH_READER	0x1
+/* pqlabs_attach(): the file takes part in the receive ring */
+#define PQLABS_ATTACH_TAP	0x2
+/* pqlabs_attach(): an aggregate tap, never the primary */
+
+/* a string descriptor as USB_IOCTL_GET_STRING returns it */
+struct pqlabs_string {
+	int                     index;			/* descriptor index, -1 if unused */
+	int                     len;			/* bLength, or <= 0 if it has none */
+	bool                    pinned;			/* read at probe, never evicted */
+	u8                      desc[256];
+};
+
+/* counters exported through debugfs and sysfs */
+struct pqlabs_stats {
+	atomic64_t              rx_submitted;		/* bulk-in urbs submitted */
+	atomic64_t              rx_completed;		/* bulk-in urbs completed */
+	atomic64_t              rx_bytes;
+	atomic64_t              tx_submitted;		/* bulk-out urbs submitted */
+	atomic64_t              tx_completed;		/* bulk-out urbs completed */
+	atomic64_t              tx_bytes;
+	atomic64_t              read_timeouts;		/* read() found no data in time */
+	atomic64_t              urb_kills;		/* urbs cancelled by the driver */
+	atomic64_t              epipe_errors;		/* stalled transfers */
+	atomic64_t              eio_errors;		/* other failed transfers */
+	atomic64_t              short_reads;		/* transfers cut by a small read() */
+	atomic64_t              write_waits;		/* writers that found no free urb */
+	atomic64_t              rx_overruns;		/* slots secondary readers lost */
+	atomic64_t              rx_skipped;		/* transfers latest mode passed over */
+	atomic64_t              rx_latency[PQLABS_HIST_BUCKETS];	/* submit to completion */
+	atomic64_t              read_wait[PQLABS_HIST_BUCKETS];	/* read() waiting for data */
+	atomic64_t              rx_suppressed;		/* transfers the idle filter dropped */
+	atomic64_t              rx_coalesced;		/* transfers whose wakeup was deferred */
+	atomic64_t              input_errors;		/* transfers the decoder rejected */
+	atomic64_t              busy_poll_hits;		/* read() spun and found a transfer */
+	atomic64_t              busy_poll_misses;	/* read() spun and went to sleep */
+	atomic64_t              resumes;		/* resumes and resets while streaming */
+	atomic64_t              resume_latency[PQLABS_HIST_BUCKETS];	/* resume to first transfer */
+};
+
+/* a preallocated write urb and its coherent buffer */
+struct pqlabs_tx_urb {
+	struct usb_pqlabs       *dev;
+	struct urb              *urb;
+	char                    *buffer;		/* MAX_TRANSFER bytes, DMA-mapped */
+	struct list_head        list;			/* on tx_free while idle */
+	ktime_t                 submitted;		/* when the urb went out */
+};
 
 /* Structure to hold all of our device specific stuff */
 struct usb_pqlabs {
@@ -66,375 +297,1925 @@ struct usb_pqlabs {
 	struct usb_interface    *interface;		/* the interface for this device */
 	struct semaphore        limit_sem;		/* limiting the number of writes in progress */
 	struct usb_anchor       submitted;		/* in case we need to retract our submissions */
-	struct urb              *bulk_in_urb;		/* the urb to read data with */
-	unsigned char           *bulk_in_buffer;	/* the buffer to receive data */
+	struct pqlabs_tx_urb    tx_urbs[WRITES_IN_FLIGHT];
+	struct list_head        tx_free;		/* idle write urbs, one per limit_sem count */
+	spinlock_t              tx_lock;		/* protects tx_free */
+	struct pqlabs_stats     stats;
+	struct dentry           *debugfs_dir;
+	struct usb_anchor       rx_submitted;		/* bulk-in urbs in flight */
+	struct pqlabs_rx_urb    rx_urbs[PQLABS_MAX_RX_URBS];
+	unsigned int            rx_urb_count;		/* number of urbs in rx_urbs */
+	struct pqlabs_rx_slot   *rx_ring;		/* received transfers, oldest at rx_tail */
+	unsigned int            rx_ring_size;		/* number of slots, a power of two */
+	unsigned int            rx_slot_order;		/* page order of a slot buffer */
+	struct device           *rx_dma_dev;		/* slots are mapped for it, or NULL */
+	struct pqlabs_ring_header *rx_shared;		/* ring header pages mapped by readers */
+	unsigned int            rx_shared_order;	/* page order of rx_shared */
+	unsigned long           rx_head;		/* next slot handed to an urb */
+	unsigned long           rx_done;		/* slots below this have completed */
+	unsigned long           rx_tail;		/* next slot of the primary reader */
+	struct list_head        rx_readers;		/* open files, oldest first */
+	struct pqlabs_file      *rx_primary;		/* the reader the urbs wait for */
+	struct list_head        node;			/* on pqlabs_devices */
+	bool                    replay;			/* slots are filled by write() */
+	struct mutex            replay_mutex;		/* one player at a time */
+	int                     replay_speed;		/* percent, 0 for no pacing */
+	bool                    replay_synced;		/* replay_base is valid */
+	s64                     replay_base_ts;		/* capture time of the reference record */
+	ktime_t                 replay_base;		/* when it was played */
+	bool                    rx_running;		/* keep urbs in flight while open */
+	bool                    rx_suspended;		/* no urbs until resume or post_reset */
+	ktime_t                 rx_resumed;		/* rearmed, no transfer yet, or 0 */
+	u64                     rx_seq;			/* sequence number of the next transfer */
+	struct pqlabs_idle_filter idle;			/* USB_IOCTL_SET_IDLE_FILTER */
+	u8                      idle_prev[PQLABS_IDLE_PREV_MAX];	/* last transfer let through */
+	size_t                  idle_prev_len;		/* its length, 0 if it did not fit */
+	bool                    idle_prev_idle;		/* it matched the idle signature */
+	ktime_t                 rx_active_until;	/* wake per transfer until then */
+	struct hrtimer          rx_coalesce;		/* deferred wakeup of the readers */
+	struct delayed_work     rx_lent_work;		/* retries slots splice() lent out */
+	const struct pqlabs_decoder *decoder;		/* from pqlabs_table */
+	struct input_dev        *input;			/* NULL unless evdev, rx_lock */
+	struct pqlabs_file      *input_file;		/* keeps urbs going while input is open */
+	struct pqlabs_contact   contacts[PQLABS_MAX_CONTACTS];	/* decoded, rx_lock */
+	char                    input_phys[64];
+	spinlock_t              rx_lock;		/* protects the rx ring and urbs */
 	size_t                  bulk_in_size;		/* the size of the receive buffer */
-	size_t                  bulk_in_filled;		/* number of bytes in the buffer */
-	size_t                  bulk_in_copied;		/* already copied to user space */
-        size_t                  bulk_total;
+	struct mutex            string_mutex;		/* protects strings */
+	struct pqlabs_string    strings[PQLABS_MAX_STRINGS];
+	unsigned int            string_next;		/* entry to replace next */
 	__u8                    bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
 	__u8                    bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
+	int                     minor;			/* N of /dev/pqlabs_bulkN, for tracing */
 	int                     errors;			/* the last request tanked */
 	int                     open_count;		/* count the number of openers */
-	bool                    ongoing_read;		/* a read is going on */
-	bool                    processed_urb;		/* indicates we haven't processed the urb */
-	bool                    submitted_urb;
 	spinlock_t              err_lock;		/* lock for errors */
 	struct kref             kref;
 	struct mutex            io_mutex;		/* synchronize I/O with disconnect */
-	struct completion       bulk_in_completion;	/* to wait for an ongoing read */
+	wait_queue_head_t       bulk_in_wait;		/* to wait for a received transfer */
+	wait_queue_head_t       bulk_out_wait;		/* to wait for a write slot */
         bool 			disconnecting;
 };
 #define to_pqlabs_dev(d) container_of(d, struct usb_pqlabs, kref)
 
+/* per open file state */
+struct pqlabs_file {
+	struct usb_pqlabs       *dev;
+	struct list_head        list;			/* on rx_readers */
+	struct mutex            read_mutex;		/* one reader at a time */
+	unsigned long           cursor;			/* next slot, unless primary */
+	u64                     overruns;		/* slots the urbs took back first */
+	int                     read_mode;		/* PQLABS_READ_* */
+	bool                    latest;			/* PQLABS_READ_LATEST */
+	unsigned long           copied_idx;		/* slot bulk_in_copied is about */
+	size_t                  bulk_in_copied;		/* already copied to user space */
+	u64                     skipped;		/* transfers it passed over */
+	s64                     read_timeout;		/* ns, or PQLABS_READ_TIMEOUT_FOREVER */
+	unsigned int            busy_poll;		/* us to spin before sleeping */
+	struct pqlabs_frame_info last;			/* for USB_IOCTL_GET_FRAME_INFO */
+	u64                     next_seq;		/* sequence expected next */
+	bool                    seen;			/* next_seq is valid */
+	bool                    tap;			/* PQLABS_ATTACH_TAP */
+	bool                    mapped;			/* mmap()ed the ring as the primary */
+};
+
 static struct usb_driver pqlabs_driver;
+static struct dentry *pqlabs_debugfs_root;
+static struct usb_pqlabs *pqlabs_replay_dev;
+
+/* every device with a receive ring, for the aggregate node */
+static LIST_HEAD(pqlabs_devices);
+static DEFINE_MUTEX(pqlabs_devices_lock);
+static unsigned int pqlabs_devices_gen;		/* bumped on every change */
+static DECLARE_WAIT_QUEUE_HEAD(pqlabs_aggregate_wait);
 static void pqlabs_draw_down(struct usb_pqlabs *dev);
 
-static void pqlabs_delete(struct kref *kref)
+static void pqlabs_stat_hist(atomic64_t *hist, s64 us)
 {
-	struct usb_pqlabs *dev = to_pqlabs_dev(kref);
+	unsigned int bucket = 0;
 
-	usb_free_urb(dev->bulk_in_urb);
-	usb_put_dev(dev->udev);
-	kfree(dev->bulk_in_buffer);
-	kfree(dev);
+	if (us > 0)
+		bucket = min_t(unsigned int, fls64(us), PQLABS_HIST_BUCKETS - 1);
+	atomic64_inc(&hist[bucket]);
 }
 
-static int pqlabs_open(struct inode *inode, struct file *file)
+static void pqlabs_stat_error(struct usb_pqlabs *dev, int status)
 {
-	struct usb_pqlabs *dev;
-	struct usb_interface *interface;
-	int subminor;
-	int retval = 0;
+	if (status == -EPIPE)
+		atomic64_inc(&dev->stats.epipe_errors);
+	else if (status != -ENOENT && status != -ECONNRESET &&
+		 status != -ESHUTDOWN)
+		atomic64_inc(&dev->stats.eio_errors);
+}
 
-	subminor = iminor(inode);
+/*
+ * the device the controller does dma with, or NULL if it takes the data
+ * through the cpu or from its own memory. usbcore then has to copy or
+ * map anyway, so there is nothing to gain from mapping ourselves.
+ */
+static struct device *pqlabs_dma_dev(struct usb_pqlabs *dev)
+{
+	struct usb_hcd *hcd = bus_to_hcd(dev->udev->bus);
 
-	interface = usb_find_interface(&pqlabs_driver, subminor);
-	if (!interface) {
-		//err("%s - error, can't find device for minor %d",
-		     //__func__, subminor);
-		retval = -ENODEV;
-		goto exit;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+	if (!hcd->self.uses_dma)
+		return NULL;
+#else
+	if (!hcd_uses_dma(hcd) || hcd->localmem_pool)
+		return NULL;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	return hcd->self.controller;
+#else
+	return hcd->self.sysdev;
+#endif
+}
+
+static void pqlabs_rx_free(struct usb_pqlabs *dev)
+{
+	struct pqlabs_rx_slot *slot;
+	unsigned int i;
+
+	for (i = 0; i < dev->rx_urb_count; i++)
+		usb_free_urb(dev->rx_urbs[i].urb);
+	dev->rx_urb_count = 0;
+
+	if (dev->rx_ring) {
+		for (i = 0; i < dev->rx_ring_size; i++) {
+			slot = &dev->rx_ring[i];
+			if (slot->dma)
+				dma_unmap_page(dev->rx_dma_dev, slot->dma,
+					       dev->bulk_in_size, DMA_FROM_DEVICE);
+			free_pages((unsigned long)slot->buffer,
+				   dev->rx_slot_order);
+		}
+		kfree(dev->rx_ring);
+		dev->rx_ring = NULL;
 	}
+	free_pages((unsigned long)dev->rx_shared, dev->rx_shared_order);
+	dev->rx_shared = NULL;
+}
 
-	dev = usb_get_intfdata(interface);
-	if (!dev) {
-		retval = -ENODEV;
-		goto exit;
+/*
+ * the slot buffers are whole zeroed pages so the ring can be handed to
+ * user space with mmap() without exposing anything else. they stay
+ * mapped for the controller as long as the device is bound, so a
+ * submission only has to hand ownership back and forth.
+ */
+static int pqlabs_rx_alloc(struct usb_pqlabs *dev)
+{
+	struct pqlabs_ring_header *hdr;
+	struct pqlabs_rx_slot *slot;
+	unsigned int nurbs, nslots, i;
+	dma_addr_t dma;
+
+	nurbs = clamp_t(unsigned int, rx_urbs, 1, PQLABS_MAX_RX_URBS);
+	nslots = roundup_pow_of_two(clamp_t(unsigned int, rx_slots, nurbs,
+					    PQLABS_MAX_RX_SLOTS));
+
+	dev->rx_shared_order = get_order(sizeof(*hdr) +
+					 nslots * sizeof(hdr->desc[0]));
+	hdr = (struct pqlabs_ring_header *)
+		__get_free_pages(GFP_KERNEL | __GFP_ZERO, dev->rx_shared_order);
+	if (!hdr)
+		return -ENOMEM;
+	dev->rx_shared = hdr;
+
+	dev->rx_ring = kcalloc(nslots, sizeof(*dev->rx_ring), GFP_KERNEL);
+	if (!dev->rx_ring)
+		return -ENOMEM;
+	dev->rx_ring_size = nslots;
+	dev->rx_slot_order = get_order(dev->bulk_in_size);
+
+	for (i = 0; i < nslots; i++) {
+		dev->rx_ring[i].dev = dev;
+		/* compound, so a page lent by splice() pins the whole slot */
+		dev->rx_ring[i].buffer = (unsigned char *)
+			__get_free_pages(GFP_KERNEL | __GFP_ZERO | __GFP_COMP,
+					 dev->rx_slot_order);
+		if (!dev->rx_ring[i].buffer)
+			return -ENOMEM;
 	}
 
-	/* increment our usage count for the device */
-	kref_get(&dev->kref);
+	hdr->magic = PQLABS_RING_MAGIC;
+	hdr->version = PQLABS_RING_VERSION;
+	hdr->slot_count = nslots;
+	hdr->slot_size = PAGE_SIZE << dev->rx_slot_order;
+	hdr->data_offset = PAGE_SIZE << dev->rx_shared_order;
+	hdr->map_size = hdr->data_offset + nslots * hdr->slot_size;
 
-	/* lock the device to allow correctly handling errors
-	 * in resumption */
-	mutex_lock(&dev->io_mutex);
+	/* the replay device fills its slots from write() */
+	if (dev->replay)
+		return 0;
 
-	if (!dev->open_count++) {
-		retval = usb_autopm_get_interface(interface);
-			if (retval) {
-				dev->open_count--;
-				mutex_unlock(&dev->io_mutex);
-				kref_put(&dev->kref, pqlabs_delete);
-				goto exit;
-			}
-	}  else { //uncomment this block if you want exclusive open
-		retval = -EBUSY;
-		dev->open_count--;
-		mutex_unlock(&dev->io_mutex);
-		kref_put(&dev->kref, pqlabs_delete);
-		goto exit;
+	dev->rx_dma_dev = pqlabs_dma_dev(dev);
+	for (i = 0; dev->rx_dma_dev && i < nslots; i++) {
+		slot = &dev->rx_ring[i];
+		dma = dma_map_page(dev->rx_dma_dev, virt_to_page(slot->buffer),
+				   0, dev->bulk_in_size, DMA_FROM_DEVICE);
+		if (dma_mapping_error(dev->rx_dma_dev, dma))
+			return -ENOMEM;
+		slot->dma = dma;
 	}
-	/* prevent the device from being autosuspended */
 
-	/* save our object in the file's private structure */
-	file->private_data = dev;
-	mutex_unlock(&dev->io_mutex);
+	for (i = 0; i < nurbs; i++) {
+		dev->rx_urbs[i].dev = dev;
+		dev->rx_urbs[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!dev->rx_urbs[i].urb)
+			return -ENOMEM;
+		dev->rx_urb_count++;
+	}
 
-exit:
-	return retval;
+	return 0;
 }
 
-static int pqlabs_release(struct inode *inode, struct file *file)
+static void pqlabs_tx_free(struct usb_pqlabs *dev)
 {
-	struct usb_pqlabs *dev;
-
-	dev = (struct usb_pqlabs *)file->private_data;
-	if (dev == NULL)
-		return -ENODEV;
+	struct pqlabs_tx_urb *tx;
+	unsigned int i;
+
+	for (i = 0; i < WRITES_IN_FLIGHT; i++) {
+		tx = &dev->tx_urbs[i];
+		if (!tx->urb)
+			continue;
+		if (tx->buffer)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+			usb_buffer_free
+#else
+			usb_free_coherent
+#endif
+				(dev->udev, MAX_TRANSFER, tx->buffer,
+				 tx->urb->transfer_dma);
+		usb_free_urb(tx->urb);
+		tx->urb = NULL;
+	}
+}
 
-	/* allow the device to be autosuspended */
-	mutex_lock(&dev->io_mutex);
-	if (!--dev->open_count && dev->interface)
-		usb_autopm_put_interface(dev->interface);
-	mutex_unlock(&dev->io_mutex);
-        spin_lock(&dev->err_lock);
-        dev->ongoing_read = 0;
-        dev->submitted_urb = 0;
-        spin_unlock(&dev->err_lock);
+/*
+ * one urb and buffer per write allowed in flight by limit_sem, so the
+ * write path never allocates
+ */
+static int pqlabs_tx_alloc(struct usb_pqlabs *dev)
+{
+	struct pqlabs_tx_urb *tx;
+	unsigned int i;
+
+	for (i = 0; i < WRITES_IN_FLIGHT; i++) {
+		tx = &dev->tx_urbs[i];
+		tx->dev = dev;
+		tx->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!tx->urb)
+			return -ENOMEM;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+		tx->buffer = usb_buffer_alloc
+#else
+		tx->buffer = usb_alloc_coherent
+#endif
+			(dev->udev, MAX_TRANSFER, GFP_KERNEL,
+			 &tx->urb->transfer_dma);
+		if (!tx->buffer)
+			return -ENOMEM;
+		list_add_tail(&tx->list, &dev->tx_free);
+	}
 
-	/* decrement the count on our device */
-	kref_put(&dev->kref, pqlabs_delete);
 	return 0;
 }
 
-static int pqlabs_flush(struct file *file, fl_owner_t id)
+static struct pqlabs_tx_urb *pqlabs_tx_get(struct usb_pqlabs *dev)
 {
-	struct usb_pqlabs *dev;
-	int res;
+	struct pqlabs_tx_urb *tx;
+	unsigned long flags;
 
-	dev = (struct usb_pqlabs *)file->private_data;
-	if (dev == NULL)
-		return -ENODEV;
+	spin_lock_irqsave(&dev->tx_lock, flags);
+	tx = list_first_entry(&dev->tx_free, struct pqlabs_tx_urb, list);
+	list_del(&tx->list);
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
 
-	/* wait for io to stop */
-	mutex_lock(&dev->io_mutex);
-	pqlabs_draw_down(dev);
+	return tx;
+}
 
-	/* read out errors, leave subsequent opens a clean slate */
-	spin_lock_irq(&dev->err_lock);
-	res = dev->errors ? (dev->errors == -EPIPE ? -EPIPE : -EIO) : 0;
-	dev->errors = 0;
-	spin_unlock_irq(&dev->err_lock);
+static void pqlabs_tx_put(struct pqlabs_tx_urb *tx)
+{
+	struct usb_pqlabs *dev = tx->dev;
+	unsigned long flags;
 
-	mutex_unlock(&dev->io_mutex);
+	spin_lock_irqsave(&dev->tx_lock, flags);
+	list_add(&tx->list, &dev->tx_free);
+	spin_unlock_irqrestore(&dev->tx_lock, flags);
 
-	return res;
+	up(&dev->limit_sem);
+	wake_up_interruptible(&dev->bulk_out_wait);
 }
 
-static void pqlabs_read_bulk_callback(struct urb *urb)
+static void pqlabs_delete(struct kref *kref)
 {
-  struct usb_pqlabs *dev;
+	struct usb_pqlabs *dev = to_pqlabs_dev(kref);
+
+	hrtimer_cancel(&dev->rx_coalesce);
+	cancel_delayed_work_sync(&dev->rx_lent_work);
+	pqlabs_rx_free(dev);
+	pqlabs_tx_free(dev);
+	usb_put_dev(dev->udev);
+	kfree(dev);
+}
 
-  dev = urb->context;
+static void pqlabs_read_bulk_callback(struct urb *urb);
 
-  /* sync/async unlink faults aren't errors */
-  if (urb->status) {
-    //err("%s - nonzero write bulk status received: %d", __func__, urb->status);
 /*
-    if (!(urb->status == -ENOENT ||
-          urb->status == -ECONNRESET ||
-          urb->status == -ESHUTDOWN))
-    err("%s - nonzero write bulk status received: %d", __func__, urb->status);
-*/
-    dev->errors = urb->status;
-  } else {
-    dev->bulk_in_filled = urb->actual_length;
-    //if (dev->bulk_in_filled == 0) dev->bulk_in_filled = dev->bulk_in_size + 1;
-  }
-
-  dev->submitted_urb = 0;
+ * pick up the consumer index of a reader working on the mmap()ed ring.
+ * the header page is writable by user space, so only accept values
+ * between our tail and the last completed slot. called with rx_lock held.
+ */
+static void pqlabs_rx_sync_tail(struct usb_pqlabs *dev)
+{
+	unsigned long consumer = (unsigned long)READ_ONCE(dev->rx_shared->consumer);
 
-  complete(&dev->bulk_in_completion);
+	/* rx_tail is the cursor of the primary, only it may move it */
+	if (!dev->rx_primary || !dev->rx_primary->mapped)
+		return;
+	if (consumer - dev->rx_tail <= dev->rx_done - dev->rx_tail)
+		dev->rx_tail = consumer;
 }
 
-static int pqlabs_do_read_io(struct usb_pqlabs *dev, size_t count)
+/*
+ * only a primary reader that is not in latest mode holds the urbs back.
+ * otherwise the oldest completed slot goes to make room. called with
+ * rx_lock held.
+ */
+static bool pqlabs_rx_drop_oldest(struct usb_pqlabs *dev)
 {
-  int rv;
+	struct pqlabs_file *pf = dev->rx_primary;
 
-  /* prepare a read */
-  usb_fill_bulk_urb(dev->bulk_in_urb,
-                    dev->udev,
-                    usb_rcvbulkpipe(dev->udev,
-                    dev->bulk_in_endpointAddr),
-                    dev->bulk_in_buffer,
-                    min(dev->bulk_in_size, count),
-                    pqlabs_read_bulk_callback,
-                    dev);
-
-  /* tell everybody to leave the URB alone */
-  //spin_lock_irq(&dev->err_lock);
-  //dev->ongoing_read = 1;
-  //spin_unlock_irq(&dev->err_lock);
-
-  /* do it */
-  rv = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
-  if (rv < 0) {
-    //err("%s - failed submitting read urb, error %d", __func__, rv);
-    dev->bulk_in_filled = 0;
-    rv = (rv == -ENOMEM) ? rv : -EIO;
-    //spin_lock_irq(&dev->err_lock);
-    //dev->ongoing_read = 0;
-    //spin_unlock_irq(&dev->err_lock);
-  }
-  else
-  {
-    dev->submitted_urb = 1;
-  }
-  return rv;
+	if (dev->rx_tail == dev->rx_done)
+		return false;
+	if (pf && !pf->latest)
+		return false;
+
+	if (pf && !dev->rx_ring[dev->rx_tail & (dev->rx_ring_size - 1)].status) {
+		pf->skipped++;
+		atomic64_inc(&dev->stats.rx_skipped);
+	}
+	dev->rx_tail++;
+	WRITE_ONCE(dev->rx_shared->consumer, dev->rx_tail);
+	return true;
 }
 
-#define READ_USB_MAX_LENGTH			(64 * 1024)
-#define READ_USB_TIMEOUT			(1000)
-static ssize_t pqlabs_read(struct file *file, char *buffer, size_t count,
-			 loff_t *ppos)
+/*
+ * splice() lent pages of the slot out and somebody, the pipe or a socket
+ * the pipe was spliced to, still holds one. the driver's own reference
+ * is the only one otherwise, remap_pfn_range() takes none. a socket lets
+ * go without telling anyone, so look again shortly while it holds on.
+ */
+static bool pqlabs_rx_slot_lent(struct usb_pqlabs *dev,
+				const struct pqlabs_rx_slot *slot)
 {
-  struct usb_pqlabs *dev;
-  int rv;
-  //bool ongoing_io;
+	if (page_count(virt_to_page(slot->buffer)) == 1)
+		return false;
+	schedule_delayed_work(&dev->rx_lent_work, 1);
+	return true;
+}
 
-  dev = (struct usb_pqlabs *)file->private_data;
+/*
+ * hand the next free ring slot to an idle urb and submit it. if the
+ * FIFO is full the urb stays parked until the reader frees a slot.
+ * called with rx_lock held.
+ */
+static int pqlabs_rx_submit(struct pqlabs_rx_urb *ru, gfp_t mem_flags)
+{
+	struct usb_pqlabs *dev = ru->dev;
+	struct pqlabs_rx_slot *slot;
+	int rv;
+
+	if (!dev->rx_running || dev->rx_suspended)
+		return -ESHUTDOWN;
+
+	if (dev->rx_head - dev->rx_tail >= dev->rx_ring_size) {
+		pqlabs_rx_sync_tail(dev);
+		if (dev->rx_head - dev->rx_tail >= dev->rx_ring_size &&
+		    !pqlabs_rx_drop_oldest(dev)) {
+			dev->rx_shared->flags |= PQLABS_RING_NEED_WAKEUP;
+			return -ENOSPC;
+		}
+	}
 
-  /* if we cannot read at all, return EOF */
-  if (!dev->bulk_in_urb || !count || count > READ_USB_MAX_LENGTH)
-    return 0;
+	/* splice() handed the old contents on, wait for them to be let go */
+	slot = &dev->rx_ring[dev->rx_head & (dev->rx_ring_size - 1)];
+	if (pqlabs_rx_slot_lent(dev, slot))
+		return -ENOSPC;
+
+	ru->slot = dev->rx_head;
+	slot->filled = 0;
+	slot->status = 0;
+	slot->ready = false;
+
+	usb_fill_bulk_urb(ru->urb,
+			  dev->udev,
+			  usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+			  slot->buffer,
+			  dev->bulk_in_size,
+			  pqlabs_read_bulk_callback,
+			  ru);
+	if (slot->dma) {
+		/* readers may have looked at the slot since it was last filled */
+		dma_sync_single_for_device(dev->rx_dma_dev, slot->dma,
+					   dev->bulk_in_size, DMA_FROM_DEVICE);
+		ru->urb->transfer_dma = slot->dma;
+		ru->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	usb_anchor_urb(ru->urb, &dev->rx_submitted);
 
-  if (dev->disconnecting)
-    return -ENODEV;
+	rv = usb_submit_urb(ru->urb, mem_flags);
+	if (rv < 0) {
+		usb_unanchor_urb(ru->urb);
+		return rv;
+	}
 
-  /* no concurrent readers */
-  rv = mutex_lock_interruptible(&dev->io_mutex);
-  if (rv < 0)
-  {
-    return rv;
-  }
+	dev->rx_head++;
+	ru->queued = true;
+	ru->submitted = ktime_get();
+	atomic64_inc(&dev->stats.rx_submitted);
+	trace_pqlabs_rx_submit(dev->minor, ru->slot, dev->bulk_in_size);
+	return 0;
+}
 
-  if (!dev->interface) {		/* disconnect() was called */
-    rv = -ENODEV;
-    goto exit;
-  }
+/* submit every parked urb the FIFO has room for. called with rx_lock held */
+static void pqlabs_rx_refill(struct usb_pqlabs *dev)
+{
+	unsigned int i;
 
-  dev->bulk_in_filled = 0;
-  dev->processed_urb = 0;
+	for (i = 0; i < dev->rx_urb_count; i++) {
+		if (dev->rx_urbs[i].queued)
+			continue;
+		if (pqlabs_rx_submit(&dev->rx_urbs[i], GFP_ATOMIC) < 0)
+			return;
+	}
+	dev->rx_shared->flags &= ~PQLABS_RING_NEED_WAKEUP;
+}
 
-  if (!(dev->processed_urb) && dev->submitted_urb)
-  {
-    rv = wait_for_completion_interruptible_timeout(&dev->bulk_in_completion, msecs_to_jiffies(READ_USB_TIMEOUT));
-    if (rv <= 0)
-    {
-      usb_kill_urb(dev->bulk_in_urb);
-      dev->submitted_urb = 0;
-      goto exit;
-    }
-  }
-  else
-  {
+/* urbs or a replay writer may be parked on a slot a socket still had */
+static void pqlabs_rx_lent_retry(struct work_struct *work)
+{
+	struct usb_pqlabs *dev = container_of(to_delayed_work(work),
+					      struct usb_pqlabs, rx_lent_work);
+
+	spin_lock_irq(&dev->rx_lock);
+	pqlabs_rx_refill(dev);
+	spin_unlock_irq(&dev->rx_lock);
+	if (dev->replay)
+		wake_up_interruptible(&dev->bulk_out_wait);
+}
 
-    rv = pqlabs_do_read_io(dev, count);
-    if (rv < 0)
-    {
-      goto exit;
-    }
+/* give slots back to the urbs after read() consumed them. rx_lock held */
+static void pqlabs_rx_consume(struct usb_pqlabs *dev, unsigned long count)
+{
+	dev->rx_tail += count;
+	WRITE_ONCE(dev->rx_shared->consumer, dev->rx_tail);
+	pqlabs_rx_refill(dev);
+	if (dev->replay)
+		wake_up_interruptible(&dev->bulk_out_wait);
+}
 
+static void pqlabs_rx_start(struct usb_pqlabs *dev)
+{
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_head = 0;
+	dev->rx_done = 0;
+	dev->rx_tail = 0;
+	dev->rx_shared->producer = 0;
+	dev->rx_shared->consumer = 0;
+	dev->rx_shared->flags = 0;
+	dev->rx_running = true;
+	pqlabs_rx_refill(dev);
+	spin_unlock_irq(&dev->rx_lock);
+}
 
-    while(1)
-    {
-      rv = wait_for_completion_interruptible_timeout(&dev->bulk_in_completion, msecs_to_jiffies(READ_USB_TIMEOUT));
-      if (rv == msecs_to_jiffies(READ_USB_TIMEOUT) && dev->bulk_in_filled == 0)
-      {
-        rv = wait_for_completion_interruptible_timeout(&dev->bulk_in_completion, msecs_to_jiffies      (READ_USB_TIMEOUT));
-      }
+/*
+ * suspend and reset keep rx_running and the ring as they are, so the
+ * urbs go back out the moment the device is usable again instead of on
+ * the next read(). the urbs themselves are killed by pqlabs_draw_down().
+ */
+static void pqlabs_rx_park(struct usb_pqlabs *dev)
+{
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_suspended = true;
+	dev->rx_resumed = 0;
+	spin_unlock_irq(&dev->rx_lock);
+}
 
-      if (rv > 0) break;
+static void pqlabs_rx_rearm(struct usb_pqlabs *dev)
+{
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_suspended = false;
+	if (dev->rx_running) {
+		atomic64_inc(&dev->stats.resumes);
+		dev->rx_resumed = ktime_get();
+		pqlabs_rx_refill(dev);
+	}
+	spin_unlock_irq(&dev->rx_lock);
+}
 
-      if (rv == 0)
-      {
-        //printk("%s: timeout!\n", __func__);
-        if (dev->disconnecting == 1)
-        {
-          printk("%s: disconnected break!\n", __func__);
-          goto exit;
-        }
-	      dev->submitted_urb = 0;
-        rv = -1;
-        usb_kill_urb(dev->bulk_in_urb);
-	      goto exit;
-      }
+static void pqlabs_rx_stop(struct usb_pqlabs *dev)
+{
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_running = false;
+	spin_unlock_irq(&dev->rx_lock);
 
-      if (rv < 0)
-      {
-      	usb_kill_urb(dev->bulk_in_urb);
-        dev->submitted_urb = 0;
-        goto exit;
-      }
-    }
-  }
+	atomic64_inc(&dev->stats.urb_kills);
+	trace_pqlabs_urb_kill(dev->minor, PQLABS_KILL_STOP);
+	usb_kill_anchored_urbs(&dev->rx_submitted);
+}
 
-  rv = dev->errors;
-  if (rv < 0)
-  {
-    dev->errors = 0;
-    rv = (rv == -EPIPE) ? rv : -EIO;
-    goto exit;
-  }
+/* a new idle filter starts from scratch. called with rx_lock held */
+static void pqlabs_rx_set_idle(struct usb_pqlabs *dev,
+			       const struct pqlabs_idle_filter *filter)
+{
+	if (filter)
+		dev->idle = *filter;
+	else
+		memset(&dev->idle, 0, sizeof(dev->idle));
+	dev->idle_prev_len = 0;
+	dev->idle_prev_idle = false;
+	dev->rx_active_until = 0;
+}
 
-  if (dev->bulk_in_filled == 0)
-  {
-    rv = 0;
-    goto exit;
-  }
+/* the slot this file reads next */
+static unsigned long pqlabs_rx_cursor(struct pqlabs_file *pf)
+{
+	struct usb_pqlabs *dev = pf->dev;
 
-  if (copy_to_user(buffer, dev->bulk_in_buffer, dev->bulk_in_filled))
-    rv = -EFAULT;
-  else
-    rv = dev->bulk_in_filled;
+	if (READ_ONCE(dev->rx_primary) == pf)
+		return READ_ONCE(dev->rx_tail);
+	return READ_ONCE(pf->cursor);
+}
 
-exit:
-  mutex_unlock(&dev->io_mutex);
-  return rv;
+/*
+ * only the primary reader holds the urbs back, unless it reads in
+ * latest mode. any other reader loses slot idx once an urb was handed
+ * the slot rx_ring_size after it. called with rx_lock held.
+ */
+static bool pqlabs_rx_overtaken(struct pqlabs_file *pf, unsigned long idx)
+{
+	struct usb_pqlabs *dev = pf->dev;
+
+	return (dev->rx_primary != pf || pf->latest) &&
+	       dev->rx_head - idx > dev->rx_ring_size;
 }
 
-static void pqlabs_write_bulk_callback(struct urb *urb)
+/* skip a secondary reader past the slots it lost. rx_lock held */
+static void pqlabs_rx_catch_up(struct pqlabs_file *pf)
 {
-	struct usb_pqlabs *dev;
+	struct usb_pqlabs *dev = pf->dev;
+	unsigned long lost;
 
-	dev = urb->context;
+	if (dev->rx_primary == pf || !pqlabs_rx_overtaken(pf, pf->cursor))
+		return;
 
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-	/*
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			err("%s - nonzero write bulk status received: %d",
-			    __func__, urb->status);
-  */
-		spin_lock(&dev->err_lock);
-		dev->errors = urb->status;
-		spin_unlock(&dev->err_lock);
+	lost = dev->rx_head - dev->rx_ring_size - pf->cursor;
+	pf->cursor += lost;
+	pf->overruns += lost;
+	atomic64_add(lost, &dev->stats.rx_overruns);
+}
+
+/* this file is done with every slot below idx. rx_lock held */
+static void pqlabs_rx_advance(struct pqlabs_file *pf, unsigned long idx)
+{
+	struct usb_pqlabs *dev = pf->dev;
+
+	if (dev->rx_primary != pf) {
+		pf->cursor = idx;
+		return;
 	}
+	if (idx - dev->rx_tail <= dev->rx_done - dev->rx_tail)
+		pqlabs_rx_consume(dev, idx - dev->rx_tail);
+}
 
-	/* free up our allocated buffer */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
-        usb_buffer_free
-#else
-	usb_free_coherent
-#endif
-                       (urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+/*
+ * latest mode: pass over everything but the newest good transfer, so a
+ * reader that fell behind gets the current state. rx_lock held.
+ */
+static void pqlabs_rx_skip_to_latest(struct pqlabs_file *pf)
+{
+	struct usb_pqlabs *dev = pf->dev;
+	unsigned long idx = pqlabs_rx_cursor(pf);
+	unsigned long newest = dev->rx_done;
+	unsigned long skipped = 0;
+
+	while (newest != idx &&
+	       dev->rx_ring[(newest - 1) & (dev->rx_ring_size - 1)].status)
+		newest--;
+	if (newest - idx <= 1)
+		return;
+
+	for (newest--; idx != newest; idx++)
+		if (!dev->rx_ring[idx & (dev->rx_ring_size - 1)].status)
+			skipped++;
+	pf->skipped += skipped;
+	atomic64_add(skipped, &dev->stats.rx_skipped);
+	pqlabs_rx_advance(pf, newest);
 }
 
-static ssize_t pqlabs_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos)
+/* a slot copied without rx_lock is only good if no urb took it meanwhile */
+static bool pqlabs_rx_stale(struct pqlabs_file *pf, unsigned long idx)
 {
-  struct usb_pqlabs *dev;
-	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	size_t writesize = min(count, (size_t)MAX_TRANSFER);
+	struct usb_pqlabs *dev = pf->dev;
+	bool stale;
 
-	dev = (struct usb_pqlabs*)file->private_data;
+	spin_lock_irq(&dev->rx_lock);
+	stale = pqlabs_rx_overtaken(pf, idx);
+	spin_unlock_irq(&dev->rx_lock);
+	return stale;
+}
 
-	/* verify that we actually have some data to write */
-	if (count == 0)
-		goto exit;
+/*
+ * make pf the primary reader, or stop it being one. nobody takes over
+ * from a primary that gives up or closes, the urbs just stop waiting.
+ * called with rx_lock held.
+ */
+static int pqlabs_rx_set_primary(struct pqlabs_file *pf, bool primary)
+{
+	struct usb_pqlabs *dev = pf->dev;
+
+	if (!primary) {
+		if (dev->rx_primary == pf) {
+			pf->cursor = dev->rx_tail;
+			dev->rx_primary = NULL;
+			pqlabs_rx_refill(dev);
+		}
+		return 0;
+	}
+	if (dev->rx_primary == pf)
+		return 0;
+	if (pf->tap)
+		return -EPERM;
+	if (dev->rx_primary)
+		return -EBUSY;
+
+	pqlabs_rx_catch_up(pf);
+	dev->rx_primary = pf;
+	dev->rx_tail = pf->cursor;
+	WRITE_ONCE(dev->rx_shared->consumer, dev->rx_tail);
+	pqlabs_rx_refill(dev);
+	return 0;
+}
+
+/* drop a closing reader. rx_lock held */
+static void pqlabs_rx_remove_reader(struct pqlabs_file *pf)
+{
+	pqlabs_rx_set_primary(pf, false);
+	list_del(&pf->list);
+}
+
+/*
+ * a new open file of dev. only readers take part in the ring, and a tap
+ * of the aggregate node can never become the primary.
+ */
+static struct pqlabs_file *pqlabs_attach(struct usb_pqlabs *dev,
+					 unsigned int flags)
+{
+	struct pqlabs_file *pf;
+	int retval = 0;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return ERR_PTR(-ENOMEM);
+	pf->dev = dev;
+	INIT_LIST_HEAD(&pf->list);
+	mutex_init(&pf->read_mutex);
+	pf->read_mode = PQLABS_READ_RAW;
+	pf->read_timeout = (s64)READ_USB_TIMEOUT * NSEC_PER_MSEC;
+	pf->tap = flags & PQLABS_ATTACH_TAP;
+
+	/* increment our usage count for the device */
+	kref_get(&dev->kref);
+
+	/* lock the device to allow correctly handling errors
+	 * in resumption */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface && !dev->replay) {	/* disconnect() was called */
+		retval = -ENODEV;
+		goto error;
+	}
+
+	if (!dev->open_count++) {
+		retval = dev->interface ? usb_autopm_get_interface(dev->interface) : 0;
+			if (retval) {
+				dev->open_count--;
+				goto error;
+			}
+		/* keep bulk-in transfers queued while the device is open */
+		if (dev->rx_ring)
+			pqlabs_rx_start(dev);
+	}
 
 	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
+	 * readers start from the live position and never hold the urbs
+	 * back until they claim it with USB_IOCTL_SET_PRIMARY. write-only
+	 * files, like a replay player, take no part in the ring.
 	 */
-	if (!(file->f_flags & O_NONBLOCK)) {
-		if (down_interruptible(&dev->limit_sem)) {
-			retval = -ERESTARTSYS;
-			goto exit;
-		}
-	} else {
+	if (dev->rx_ring && (flags & PQLABS_ATTACH_READER)) {
+		spin_lock_irq(&dev->rx_lock);
+		pf->cursor = dev->rx_done;
+		list_add_tail(&pf->list, &dev->rx_readers);
+		spin_unlock_irq(&dev->rx_lock);
+	}
+	mutex_unlock(&dev->io_mutex);
+	return pf;
+
+error:
+	mutex_unlock(&dev->io_mutex);
+	kref_put(&dev->kref, pqlabs_delete);
+	kfree(pf);
+	return ERR_PTR(retval);
+}
+
+static void pqlabs_detach(struct pqlabs_file *pf)
+{
+	struct usb_pqlabs *dev = pf->dev;
+
+	mutex_lock(&dev->io_mutex);
+	if (!list_empty(&pf->list)) {
+		spin_lock_irq(&dev->rx_lock);
+		pqlabs_rx_remove_reader(pf);
+		spin_unlock_irq(&dev->rx_lock);
+	}
+
+	/* allow the device to be autosuspended */
+	if (!--dev->open_count) {
+		if (dev->rx_ring)
+			pqlabs_rx_stop(dev);
+		/* the next user starts with everything passed through */
+		spin_lock_irq(&dev->rx_lock);
+		pqlabs_rx_set_idle(dev, NULL);
+		spin_unlock_irq(&dev->rx_lock);
+		if (dev->interface)
+			usb_autopm_put_interface(dev->interface);
+	}
+	mutex_unlock(&dev->io_mutex);
+
+	/* decrement the count on our device */
+	kref_put(&dev->kref, pqlabs_delete);
+	kfree(pf);
+}
+
+/*
+ * read() and write() honour IOCB_NOWAIT, so io_uring may issue them
+ * inline and fall back to poll() instead of handing each one to a worker
+ */
+static void pqlabs_set_nowait(struct file *file)
+{
+#ifdef FMODE_NOWAIT
+	file->f_mode |= FMODE_NOWAIT;
+#endif
+}
+
+static int pqlabs_open(struct inode *inode, struct file *file)
+{
+	struct pqlabs_file *pf;
+	struct usb_pqlabs *dev;
+	struct usb_interface *interface;
+	int subminor;
+
+	subminor = iminor(inode);
+
+	interface = usb_find_interface(&pqlabs_driver, subminor);
+	if (!interface) {
+		//err("%s - error, can't find device for minor %d",
+		     //__func__, subminor);
+		return -ENODEV;
+	}
+
+	dev = usb_get_intfdata(interface);
+	if (!dev)
+		return -ENODEV;
+
+	pf = pqlabs_attach(dev, file->f_mode & FMODE_READ ?
+				PQLABS_ATTACH_READER : 0);
+	if (IS_ERR(pf))
+		return PTR_ERR(pf);
+
+	/* save our object in the file's private structure */
+	file->private_data = pf;
+	pqlabs_set_nowait(file);
+	return 0;
+}
+
+static int pqlabs_replay_open(struct inode *inode, struct file *file)
+{
+	struct pqlabs_file *pf;
+
+	pf = pqlabs_attach(pqlabs_replay_dev, file->f_mode & FMODE_READ ?
+			   PQLABS_ATTACH_READER : 0);
+	if (IS_ERR(pf))
+		return PTR_ERR(pf);
+	file->private_data = pf;
+	/* the player sleeps to pace its records */
+	if (!(file->f_mode & FMODE_WRITE))
+		pqlabs_set_nowait(file);
+	return 0;
+}
+
+static int pqlabs_release(struct inode *inode, struct file *file)
+{
+	struct pqlabs_file *pf;
+
+	pf = (struct pqlabs_file *)file->private_data;
+	if (pf == NULL)
+		return -ENODEV;
+
+	pqlabs_detach(pf);
+	return 0;
+}
+
+static int pqlabs_flush(struct file *file, fl_owner_t id)
+{
+	struct pqlabs_file *pf;
+	struct usb_pqlabs *dev;
+	int res;
+
+	pf = (struct pqlabs_file *)file->private_data;
+	if (pf == NULL)
+		return -ENODEV;
+	dev = pf->dev;
+
+	/* wait for writes to stop, reads keep streaming until release */
+	mutex_lock(&dev->io_mutex);
+	if (!usb_wait_anchor_empty_timeout(&dev->submitted, 1000)) {
+		atomic64_inc(&dev->stats.urb_kills);
+		trace_pqlabs_urb_kill(dev->minor, PQLABS_KILL_FLUSH);
+		usb_kill_anchored_urbs(&dev->submitted);
+	}
+
+	/* read out errors, leave subsequent opens a clean slate */
+	spin_lock_irq(&dev->err_lock);
+	res = dev->errors ? (dev->errors == -EPIPE ? -EPIPE : -EIO) : 0;
+	dev->errors = 0;
+	spin_unlock_irq(&dev->err_lock);
+
+	mutex_unlock(&dev->io_mutex);
+
+	return res;
+}
+
+static bool pqlabs_rx_unlinked(int status)
+{
+  return status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN ||
+         status == -ENODATA;	/* dropped by the idle filter */
+}
+
+static void pqlabs_rx_header(const struct pqlabs_rx_slot *slot,
+                             struct pqlabs_frame_header *hdr)
+{
+  hdr->length = slot->filled;
+  hdr->status = slot->status;
+  hdr->sequence = slot->seq;
+  hdr->timestamp_ns = ktime_to_ns(slot->ts);
+  hdr->usb_frame = slot->usb_frame < 0 ? 0 : slot->usb_frame;
+  hdr->reserved = 0;
+}
+
+static void pqlabs_rx_wake(struct usb_pqlabs *dev)
+{
+  wake_up_interruptible(&dev->bulk_in_wait);
+  if (aggregate)
+    wake_up_interruptible(&pqlabs_aggregate_wait);
+}
+
+static enum hrtimer_restart pqlabs_rx_coalesced(struct hrtimer *timer)
+{
+  pqlabs_rx_wake(container_of(timer, struct usb_pqlabs, rx_coalesce));
+  return HRTIMER_NORESTART;
+}
+
+/* hand the contacts of a received transfer to the input device. rx_lock held */
+static void pqlabs_input_report(struct usb_pqlabs *dev,
+                                const struct pqlabs_rx_slot *slot)
+{
+  struct input_dev *input = dev->input;
+  struct pqlabs_contact *c;
+  int count, i, s;
+
+  /* zero length packets only end frames */
+  if (!slot->filled)
+    return;
+
+  count = dev->decoder->decode(slot->buffer, slot->filled, dev->contacts);
+  if (count < 0)
+  {
+    atomic64_inc(&dev->stats.input_errors);
+    return;
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    c = &dev->contacts[i];
+    s = input_mt_get_slot_by_key(input, c->id);
+    if (s < 0)
+      continue;
+    input_mt_slot(input, s);
+    if (!input_mt_report_slot_state(input, MT_TOOL_FINGER, c->down))
+      continue;
+    input_report_abs(input, ABS_MT_POSITION_X, c->x);
+    input_report_abs(input, ABS_MT_POSITION_Y, c->y);
+  }
+  /* contacts missing from the report were lifted */
+  input_mt_sync_frame(input);
+  input_sync(input);
+}
+
+/*
+ * the idle filter: true if the transfer in slot says nothing new, it
+ * equals the one let through before or it is idle after an idle one.
+ * the first idle transfer after a touch always goes through, so the
+ * reader sees the contacts lift. called with rx_lock held.
+ */
+static bool pqlabs_rx_filter(struct usb_pqlabs *dev, struct pqlabs_rx_slot *slot)
+{
+  const struct pqlabs_idle_filter *f = &dev->idle;
+  bool idle = f->length && slot->filled >= f->length;
+  u32 i;
+
+  /* zero length packets end frames, leave them alone */
+  if (!slot->filled)
+    return false;
+
+  for (i = 0; idle && i < f->length; i++)
+    idle = !((slot->buffer[i] ^ f->signature[i]) & f->mask[i]);
+
+  if ((f->flags & PQLABS_IDLE_DUPLICATES) && slot->filled == dev->idle_prev_len &&
+      !memcmp(slot->buffer, dev->idle_prev, slot->filled))
+    return true;
+  if ((f->flags & PQLABS_IDLE_SIGNATURE) && idle && dev->idle_prev_idle)
+    return true;
+
+  dev->idle_prev_idle = idle;
+  dev->idle_prev_len = 0;
+  if (slot->filled <= sizeof(dev->idle_prev))
+  {
+    memcpy(dev->idle_prev, slot->buffer, slot->filled);
+    dev->idle_prev_len = slot->filled;
+  }
+  if (!idle)
+    dev->rx_active_until = ktime_add_ms(slot->ts, PQLABS_TOUCH_HOLD_MS);
+  return false;
+}
+
+/*
+ * no reader wants a slot the idle filter dropped or an urb was unlinked
+ * from, so give those at the tail back right away. a wall that stays
+ * idle would fill the ring with them otherwise, and the reader is never
+ * woken to read past them. called with rx_lock held.
+ */
+static void pqlabs_rx_trim(struct usb_pqlabs *dev)
+{
+  unsigned long tail = dev->rx_tail;
+
+  while (tail != dev->rx_done &&
+         pqlabs_rx_unlinked(dev->rx_ring[tail & (dev->rx_ring_size - 1)].status))
+    tail++;
+  if (tail == dev->rx_tail)
+    return;
+
+  dev->rx_tail = tail;
+  WRITE_ONCE(dev->rx_shared->consumer, tail);
+}
+
+/*
+ * record the outcome of the transfer into slot idx and publish every
+ * slot completed so far. returns whether to wake the readers now; a
+ * coalesced wakeup comes from rx_coalesce instead. called with rx_lock
+ * held.
+ */
+static bool pqlabs_rx_complete(struct usb_pqlabs *dev, unsigned long idx,
+                               int status, u32 length, int usb_frame,
+                               ktime_t submitted)
+{
+  struct pqlabs_rx_slot *slot;
+  bool suppressed;
+
+  /* sync/async unlink faults aren't errors, read() skips those slots */
+  slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+  slot->status = status;
+  slot->filled = status ? 0 : length;
+  slot->ts = ktime_get();
+  slot->usb_frame = usb_frame;
+  atomic64_add(slot->filled, &dev->stats.rx_bytes);
+
+  suppressed = !status && pqlabs_rx_filter(dev, slot);
+  if (suppressed)
+  {
+    slot->status = -ENODATA;
+    slot->filled = 0;
+    atomic64_inc(&dev->stats.rx_suppressed);
+  }
+  if (!slot->status && dev->input)
+    pqlabs_input_report(dev, slot);
+  if (!pqlabs_rx_unlinked(slot->status))
+  {
+    slot->seq = dev->rx_seq++;
+    pqlabs_stat_hist(dev->stats.rx_latency, ktime_us_delta(slot->ts, submitted));
+  }
+  if (!status && dev->rx_resumed)
+  {
+    pqlabs_stat_hist(dev->stats.resume_latency, ktime_us_delta(slot->ts, dev->rx_resumed));
+    dev->rx_resumed = 0;
+  }
+  slot->ready = true;
+  trace_pqlabs_rx_complete(dev->minor, idx, status, slot->filled, slot->seq,
+                           ktime_to_ns(ktime_sub(slot->ts, submitted)));
+
+  atomic64_inc(&dev->stats.rx_completed);
+  pqlabs_stat_error(dev, status);
+  pqlabs_rx_header(slot, &dev->rx_shared->desc[idx & (dev->rx_ring_size - 1)]);
+
+  /* completions arrive in order, but be safe about unlinked urbs */
+  while (dev->rx_done != dev->rx_head &&
+         dev->rx_ring[dev->rx_done & (dev->rx_ring_size - 1)].ready)
+    dev->rx_done++;
+  /* publish the slot descriptors before the new producer index */
+  smp_store_release(&dev->rx_shared->producer, dev->rx_done);
+  pqlabs_rx_trim(dev);
+
+  if (suppressed)
+    return false;
+  /* nobody is touching: let a few transfers pile up per wakeup */
+  if (!status && dev->idle.coalesce_us &&
+      !ktime_before(slot->ts, dev->rx_active_until))
+  {
+    if (!hrtimer_active(&dev->rx_coalesce))
+      hrtimer_start(&dev->rx_coalesce, us_to_ktime(dev->idle.coalesce_us),
+                    HRTIMER_MODE_REL);
+    atomic64_inc(&dev->stats.rx_coalesced);
+    return false;
+  }
+  return true;
+}
+
+static void pqlabs_read_bulk_callback(struct urb *urb)
+{
+  struct pqlabs_rx_urb *ru = urb->context;
+  struct usb_pqlabs *dev = ru->dev;
+  struct pqlabs_rx_slot *slot;
+  unsigned long flags;
+  bool wake;
+
+  slot = &dev->rx_ring[ru->slot & (dev->rx_ring_size - 1)];
+  if (slot->dma)
+    dma_sync_single_for_cpu(dev->rx_dma_dev, slot->dma, urb->actual_length,
+                            DMA_FROM_DEVICE);
+
+  spin_lock_irqsave(&dev->rx_lock, flags);
+  ru->queued = false;
+  wake = pqlabs_rx_complete(dev, ru->slot, urb->status, urb->actual_length,
+                            usb_get_current_frame_number(dev->udev), ru->submitted);
+
+  /*
+   * keep the pipe busy, with the urbs a full ring parked as well if the
+   * completion freed slots. a failed endpoint waits for read() to refill
+   */
+  if (!urb->status)
+    pqlabs_rx_refill(dev);
+  spin_unlock_irqrestore(&dev->rx_lock, flags);
+
+  if (wake)
+    pqlabs_rx_wake(dev);
+}
+
+/*
+ * a device frame spans the transfers up to and including the first
+ * short one, so a frame of a multiple of bulk_in_size ends with a zero
+ * length packet. failed transfers end a frame as well. finds the slot
+ * after the frame starting at idx, if it completed.
+ */
+static bool pqlabs_rx_frame_end(struct usb_pqlabs *dev, unsigned long idx,
+                                unsigned long done, unsigned long *end)
+{
+  const struct pqlabs_rx_slot *slot;
+
+  for (*end = idx; *end != done; )
+  {
+    slot = &dev->rx_ring[(*end)++ & (dev->rx_ring_size - 1)];
+    if (slot->status || slot->filled < dev->bulk_in_size)
+      return true;
+  }
+  /* a frame bigger than the whole ring is cut where it stands */
+  return *end - idx >= dev->rx_ring_size;
+}
+
+static bool pqlabs_rx_pending(struct pqlabs_file *pf)
+{
+  unsigned long idx = pqlabs_rx_cursor(pf);
+  unsigned long done = READ_ONCE(pf->dev->rx_done);
+  unsigned long end;
+
+  if (pf->read_mode == PQLABS_READ_ALIGNED)
+    return pqlabs_rx_frame_end(pf->dev, idx, done, &end);
+  return idx != done;
+}
+
+/*
+ * the next slot of this file worth reporting, without waiting. transfers
+ * killed by suspend or release are skipped.
+ */
+static bool pqlabs_rx_peek(struct pqlabs_file *pf, unsigned long *idx)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  bool found = false;
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_catch_up(pf);
+  if (pf->latest)
+    pqlabs_rx_skip_to_latest(pf);
+  while ((*idx = pqlabs_rx_cursor(pf)) != dev->rx_done)
+  {
+    if (!pqlabs_rx_unlinked(dev->rx_ring[*idx & (dev->rx_ring_size - 1)].status))
+    {
+      found = true;
+      break;
+    }
+    pqlabs_rx_advance(pf, *idx + 1);
+  }
+  spin_unlock_irq(&dev->rx_lock);
+  return found;
+}
+
+/*
+ * spin until end for a transfer, so a reader that gets one by then does
+ * not pay for a wakeup. gives up early for anything else that wants
+ * the cpu.
+ */
+static bool pqlabs_rx_busy_poll(struct pqlabs_file *pf, ktime_t end)
+{
+  struct usb_pqlabs *dev = pf->dev;
+
+  do
+  {
+    if (pqlabs_rx_pending(pf))
+    {
+      atomic64_inc(&dev->stats.busy_poll_hits);
+      return true;
+    }
+    cpu_relax();
+  } while (!need_resched() && !signal_pending(current) &&
+           !dev->disconnecting && ktime_before(ktime_get(), end));
+
+  atomic64_inc(&dev->stats.busy_poll_misses);
+  return false;
+}
+
+/*
+ * wait until the next slot of this file holds a completed transfer
+ * worth reporting. called with read_mutex held.
+ */
+static int pqlabs_rx_wait(struct pqlabs_file *pf, bool nonblock)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  unsigned long idx;
+  s64 timeout = READ_ONCE(pf->read_timeout);
+  unsigned int busy_poll = READ_ONCE(pf->busy_poll);
+  ktime_t start = ktime_get();
+  ktime_t deadline, remaining;
+  int rv;
+
+  /* resubmit urbs parked by a full FIFO, an error or a suspend */
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_refill(dev);
+  spin_unlock_irq(&dev->rx_lock);
+
+  if (timeout == PQLABS_READ_TIMEOUT_NONE)
+    nonblock = true;
+  /* a deadline past KTIME_MAX would wrap negative and expire at once */
+  if (timeout > KTIME_MAX - start)
+    timeout = PQLABS_READ_TIMEOUT_FOREVER;
+  deadline = ktime_add_ns(start, timeout);
+  for (;;)
+  {
+    if (!pqlabs_rx_pending(pf))
+    {
+      if (nonblock)
+        return -EAGAIN;
+
+      /* once per read(), before the first sleep */
+      if (busy_poll)
+      {
+        remaining = ktime_add_us(start, busy_poll);
+        if (timeout >= 0 && ktime_after(remaining, deadline))
+          remaining = deadline;
+        busy_poll = 0;
+        if (pqlabs_rx_busy_poll(pf, remaining))
+          continue;
+      }
+
+      if (timeout == PQLABS_READ_TIMEOUT_FOREVER)
+      {
+        rv = wait_event_interruptible(dev->bulk_in_wait,
+                                      pqlabs_rx_pending(pf) || dev->disconnecting);
+      }
+      else
+      {
+        /* hrtimer based, so short timeouts are not rounded up to jiffies */
+        remaining = ktime_sub(deadline, ktime_get());
+        if (remaining < 0)
+          remaining = 0;
+        rv = wait_event_interruptible_hrtimeout(dev->bulk_in_wait,
+                                                pqlabs_rx_pending(pf) || dev->disconnecting,
+                                                remaining);
+      }
+      if (rv < 0 && rv != -ETIME)
+        return rv;
+    }
+
+    if (dev->disconnecting)
+    {
+      printk("%s: disconnected break!\n", __func__);
+      return -ENODEV;
+    }
+
+    /* timeout, the urbs stay queued for the next read */
+    if (!pqlabs_rx_pending(pf))
+    {
+      atomic64_inc(&dev->stats.read_timeouts);
+      trace_pqlabs_read_timeout(dev->minor, ktime_to_ns(ktime_sub(ktime_get(), start)));
+      return -1;
+    }
+
+    if (pqlabs_rx_peek(pf, &idx))
+    {
+      pqlabs_stat_hist(dev->stats.read_wait, ktime_us_delta(ktime_get(), start));
+      return 0;
+    }
+  }
+}
+
+/* remember what was handed to this reader and count the gaps */
+static void pqlabs_file_note(struct pqlabs_file *pf,
+                             const struct pqlabs_frame_header *hdr)
+{
+  trace_pqlabs_copy_to_user(pf->dev->minor, hdr->sequence, hdr->length,
+                            ktime_get_ns() - hdr->timestamp_ns);
+
+  if (pf->seen && hdr->sequence > pf->next_seq)
+    pf->last.missed += hdr->sequence - pf->next_seq;
+  pf->next_seq = hdr->sequence + 1;
+  pf->seen = true;
+
+  pf->last.frame = *hdr;
+  pf->last.read_ns = ktime_get_ns();
+}
+
+/* one transfer per read(), cut to the size of the caller's buffer */
+static ssize_t pqlabs_read_raw(struct pqlabs_file *pf, struct iov_iter *to)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  struct pqlabs_frame_header hdr;
+  struct pqlabs_rx_slot *slot;
+  unsigned long idx;
+  size_t len;
+  ssize_t rv;
+
+  /* a latest mode primary may have dropped what rx_wait found */
+  spin_lock_irq(&dev->rx_lock);
+  idx = pqlabs_rx_cursor(pf);
+  rv = idx == dev->rx_done ? -ESTALE : 0;
+  spin_unlock_irq(&dev->rx_lock);
+  if (rv < 0)
+    return rv;
+
+  slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+  pqlabs_rx_header(slot, &hdr);
+
+  rv = slot->status;
+  if (rv < 0)
+  {
+    rv = (rv == -EPIPE) ? rv : -EIO;
+  }
+  else if (slot->filled)
+  {
+    len = min(slot->filled, iov_iter_count(to));
+    if (len < slot->filled)
+      atomic64_inc(&dev->stats.short_reads);
+    if (copy_to_iter(slot->buffer, len, to) != len)
+      rv = -EFAULT;
+    else
+      rv = len;
+  }
+
+  /* the urbs reused the slot while we copied it */
+  if (pqlabs_rx_stale(pf, idx))
+  {
+    if (rv > 0)
+      iov_iter_revert(to, rv);
+    return -ESTALE;
+  }
+  if (rv != -EFAULT)
+    pqlabs_file_note(pf, &hdr);
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_advance(pf, idx + 1);
+  spin_unlock_irq(&dev->rx_lock);
+
+  return rv;
+}
+
+/*
+ * every completed transfer that fits, each behind a struct
+ * pqlabs_frame_header. failed transfers show up as a header with the
+ * error in status and no data.
+ */
+static ssize_t pqlabs_read_frames(struct pqlabs_file *pf, struct iov_iter *to)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  struct pqlabs_frame_header hdr;
+  struct pqlabs_rx_slot *slot;
+  unsigned long idx, done;
+  ssize_t copied = 0;
+  bool stale = false;
+
+  spin_lock_irq(&dev->rx_lock);
+  idx = pqlabs_rx_cursor(pf);
+  done = dev->rx_done;
+  if (pf->latest && idx != done)
+    done = idx + 1;
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* a latest mode primary may have dropped what rx_wait found */
+  stale = idx == done;
+
+  for (; idx != done; idx++)
+  {
+    slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+    if (pqlabs_rx_unlinked(slot->status))
+      continue;
+
+    pqlabs_rx_header(slot, &hdr);
+    if (sizeof(hdr) + hdr.length > iov_iter_count(to))
+      break;
+
+    if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr) ||
+        copy_to_iter(slot->buffer, hdr.length, to) != hdr.length)
+    {
+      if (!copied)
+        copied = -EFAULT;
+      break;
+    }
+    if (pqlabs_rx_stale(pf, idx))
+    {
+      iov_iter_revert(to, sizeof(hdr) + hdr.length);
+      stale = true;
+      break;
+    }
+    copied += sizeof(hdr) + hdr.length;
+    pqlabs_file_note(pf, &hdr);
+  }
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_advance(pf, idx);
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* not even the oldest frame fits */
+  if (!copied)
+    copied = stale ? -ESTALE : -EMSGSIZE;
+  return copied;
+}
+
+/*
+ * PQLABS_READ_STREAM: the transfers back to back as one byte stream. a
+ * transfer that does not fit is finished by the next read(), its slot
+ * stays with this file until then.
+ */
+static ssize_t pqlabs_read_stream(struct pqlabs_file *pf, struct iov_iter *to)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  struct pqlabs_frame_header hdr;
+  struct pqlabs_rx_slot *slot;
+  unsigned long idx, done;
+  size_t offset, len, n;
+  ssize_t copied = 0;
+
+  spin_lock_irq(&dev->rx_lock);
+  idx = pqlabs_rx_cursor(pf);
+  done = dev->rx_done;
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* kept until the slot is used up, so a fault does not repeat bytes */
+  offset = pf->copied_idx == idx ? pf->bulk_in_copied : 0;
+
+  for (; idx != done && iov_iter_count(to); idx++, offset = 0)
+  {
+    slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+    if (pqlabs_rx_unlinked(slot->status))
+      continue;
+
+    /* a failed transfer is reported on its own, as in raw mode */
+    pqlabs_rx_header(slot, &hdr);
+    if (slot->status < 0)
+    {
+      if (copied)
+        break;
+      if (pqlabs_rx_stale(pf, idx))
+        break;
+      copied = (slot->status == -EPIPE) ? -EPIPE : -EIO;
+      pqlabs_file_note(pf, &hdr);
+      idx++;
+      break;
+    }
+
+    len = min(hdr.length - offset, iov_iter_count(to));
+    n = copy_to_iter(slot->buffer + offset, len, to);
+    if (pqlabs_rx_stale(pf, idx))
+    {
+      iov_iter_revert(to, n);
+      break;
+    }
+    copied += n;
+
+    if (offset + n < hdr.length)
+    {
+      pf->copied_idx = idx;
+      pf->bulk_in_copied = offset + n;
+      if (n != len && !copied)
+        copied = -EFAULT;
+      break;
+    }
+    pf->bulk_in_copied = 0;
+    pqlabs_file_note(pf, &hdr);
+  }
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_advance(pf, idx);
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* overtaken, or only cancelled transfers: try what is left */
+  if (!copied)
+    copied = -ESTALE;
+  return copied;
+}
+
+/*
+ * PQLABS_READ_ALIGNED: exactly one device frame per read(), joined from
+ * as many transfers as it took. rx_wait saw the frame complete.
+ */
+static ssize_t pqlabs_read_aligned(struct pqlabs_file *pf, struct iov_iter *to)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  struct pqlabs_frame_header hdr;
+  struct pqlabs_rx_slot *slot;
+  unsigned long first, idx, end, done;
+  size_t total = 0;
+  ssize_t rv = 0;
+
+  spin_lock_irq(&dev->rx_lock);
+  first = pqlabs_rx_cursor(pf);
+  done = dev->rx_done;
+  spin_unlock_irq(&dev->rx_lock);
+
+  if (!pqlabs_rx_frame_end(dev, first, done, &end))
+    return -ESTALE;
+
+  for (idx = first; idx != end; idx++)
+  {
+    slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+    if (slot->status < 0)
+    {
+      /* a frame cut short by an error is dropped with it */
+      if (!pqlabs_rx_unlinked(slot->status))
+        rv = (slot->status == -EPIPE) ? -EPIPE : -EIO;
+      total = 0;
+      break;
+    }
+    total += slot->filled;
+  }
+  if (total > iov_iter_count(to))
+    return -EMSGSIZE;
+
+  for (idx = first; !rv && total && idx != end; idx++)
+  {
+    slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+    if (copy_to_iter(slot->buffer, slot->filled, to) != slot->filled)
+      rv = -EFAULT;
+  }
+  if (!rv)
+    rv = total;
+
+  if (pqlabs_rx_stale(pf, first))
+  {
+    if (rv > 0)
+      iov_iter_revert(to, rv);
+    return -ESTALE;
+  }
+  /* the header of the last transfer stands for the frame */
+  if (rv != -EFAULT)
+  {
+    slot = &dev->rx_ring[(end - 1) & (dev->rx_ring_size - 1)];
+    pqlabs_rx_header(slot, &hdr);
+    hdr.length = total;
+    pqlabs_file_note(pf, &hdr);
+  }
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_advance(pf, end);
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* an empty or cancelled frame, go on with the next one */
+  if (!rv)
+    rv = -ESTALE;
+  return rv;
+}
+
+static ssize_t pqlabs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct file *file = iocb->ki_filp;
+  struct pqlabs_file *pf;
+  struct usb_pqlabs *dev;
+  size_t count = iov_iter_count(to);
+  bool nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+  ssize_t rv;
+
+  pf = (struct pqlabs_file *)file->private_data;
+  dev = pf->dev;
+
+  /* if we cannot read at all, return EOF */
+  if (!dev->rx_ring || !count)
+    return 0;
+  if (pf->read_mode == PQLABS_READ_RAW && count > READ_USB_MAX_LENGTH)
+    return 0;
+
+  if (dev->disconnecting)
+    return -ENODEV;
+
+  /*
+   * no concurrent readers on one file. io_mutex is left to writers and
+   * disconnect: the ring only resubmits urbs while rx_running, which
+   * disconnect clears under rx_lock before the interface goes away.
+   */
+  if (nonblock)
+  {
+    if (!mutex_trylock(&pf->read_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    rv = mutex_lock_interruptible(&pf->read_mutex);
+    if (rv < 0)
+    {
+      return rv;
+    }
+  }
+
+  if (!dev->interface && !dev->replay) {		/* disconnect() was called */
+    rv = -ENODEV;
+    goto exit;
+  }
+
+  do
+  {
+    rv = pqlabs_rx_wait(pf, nonblock);
+    if (rv < 0)
+      goto exit;
+
+    /* a failed write is reported once, the transfer stays queued */
+    spin_lock_irq(&dev->err_lock);
+    rv = dev->errors;
+    dev->errors = 0;
+    spin_unlock_irq(&dev->err_lock);
+    if (rv < 0)
+    {
+      rv = (rv == -EPIPE) ? rv : -EIO;
+      goto exit;
+    }
+
+    if (pf->read_mode == PQLABS_READ_FRAMES)
+      rv = pqlabs_read_frames(pf, to);
+    else if (pf->read_mode == PQLABS_READ_STREAM)
+      rv = pqlabs_read_stream(pf, to);
+    else if (pf->read_mode == PQLABS_READ_ALIGNED)
+      rv = pqlabs_read_aligned(pf, to);
+    else
+      rv = pqlabs_read_raw(pf, to);
+  } while (rv == -ESTALE);	/* overtaken, try the oldest slot left */
+
+exit:
+  mutex_unlock(&pf->read_mutex);
+  return rv;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+/*
+ * splice() lends the pages of a slot to the pipe, each with a page
+ * reference. whatever the pipe passes them on to, a socket say, takes
+ * its own, and the slot is not handed to an urb again before all of
+ * them are gone, see pqlabs_rx_slot_lent(). every pipe buffer also
+ * holds the device, so the ring outlives a disconnect, and the module,
+ * since the pipe calls back into these ops.
+ */
+static void pqlabs_pipe_buf_release(struct pipe_inode_info *pipe,
+                                    struct pipe_buffer *buf)
+{
+  struct pqlabs_rx_slot *slot = (struct pqlabs_rx_slot *)buf->private;
+  struct usb_pqlabs *dev = slot->dev;
+  unsigned long flags;
+
+  put_page(buf->page);
+  if (!pqlabs_rx_slot_lent(dev, slot))
+  {
+    spin_lock_irqsave(&dev->rx_lock, flags);
+    pqlabs_rx_refill(dev);
+    spin_unlock_irqrestore(&dev->rx_lock, flags);
+    if (dev->replay)
+      wake_up_interruptible(&dev->bulk_out_wait);
+  }
+  kref_put(&dev->kref, pqlabs_delete);
+  module_put(THIS_MODULE);
+}
+
+static bool pqlabs_pipe_buf_get(struct pipe_inode_info *pipe,
+                                struct pipe_buffer *buf)
+{
+  struct pqlabs_rx_slot *slot = (struct pqlabs_rx_slot *)buf->private;
+
+  __module_get(THIS_MODULE);
+  kref_get(&slot->dev->kref);
+  get_page(buf->page);
+  return true;
+}
+
+static const struct pipe_buf_operations pqlabs_pipe_buf_ops = {
+  .release = pqlabs_pipe_buf_release,
+  .get = pqlabs_pipe_buf_get,
+};
+
+/* pages splice_to_pipe() did not take */
+static void pqlabs_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+  struct pqlabs_rx_slot *slot = (struct pqlabs_rx_slot *)spd->partial[i].private;
+
+  put_page(spd->pages[i]);
+  kref_put(&slot->dev->kref, pqlabs_delete);
+  module_put(THIS_MODULE);
+}
+
+/*
+ * lend the rest of the next transfer to the pipe. as in
+ * PQLABS_READ_STREAM a transfer the pipe has no room for is continued
+ * by the next call.
+ */
+static ssize_t pqlabs_splice_slot(struct pqlabs_file *pf,
+                                  struct pipe_inode_info *pipe, size_t len)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  struct page *pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+    .pages = pages,
+    .partial = partial,
+    .nr_pages_max = PIPE_DEF_BUFFERS,
+    .ops = &pqlabs_pipe_buf_ops,
+    .spd_release = pqlabs_spd_release,
+  };
+  struct pqlabs_frame_header hdr;
+  struct pqlabs_rx_slot *slot;
+  unsigned long idx;
+  size_t offset, end, chunk;
+  ssize_t rv;
+
+  spin_lock_irq(&dev->rx_lock);
+  idx = pqlabs_rx_cursor(pf);
+  rv = idx == dev->rx_done ? -ESTALE : 0;
+  spin_unlock_irq(&dev->rx_lock);
+  if (rv < 0)
+    return rv;
+
+  slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+  pqlabs_rx_header(slot, &hdr);
+  if (hdr.status < 0)
+  {
+    pqlabs_file_note(pf, &hdr);
+    spin_lock_irq(&dev->rx_lock);
+    pqlabs_rx_advance(pf, idx + 1);
+    spin_unlock_irq(&dev->rx_lock);
+    return (hdr.status == -EPIPE) ? -EPIPE : -EIO;
+  }
+
+  offset = pf->copied_idx == idx ? pf->bulk_in_copied : 0;
+  end = offset + min(len, hdr.length - offset);
+  while (offset < end && spd.nr_pages < PIPE_DEF_BUFFERS)
+  {
+    chunk = min_t(size_t, end - offset,
+                  PAGE_SIZE - offset_in_page(slot->buffer + offset));
+    pages[spd.nr_pages] = virt_to_page(slot->buffer + offset);
+    partial[spd.nr_pages].offset = offset_in_page(slot->buffer + offset);
+    partial[spd.nr_pages].len = chunk;
+    partial[spd.nr_pages].private = (unsigned long)slot;
+    get_page(pages[spd.nr_pages]);
+    kref_get(&dev->kref);
+    __module_get(THIS_MODULE);
+    spd.nr_pages++;
+    offset += chunk;
+  }
+
+  rv = spd.nr_pages ? splice_to_pipe(pipe, &spd) : 0;
+  if (rv <= 0)
+    return rv;
+
+  offset = (pf->copied_idx == idx ? pf->bulk_in_copied : 0) + rv;
+  if (offset < hdr.length)
+  {
+    pf->copied_idx = idx;
+    pf->bulk_in_copied = offset;
+    return rv;
+  }
+  pf->bulk_in_copied = 0;
+  pqlabs_file_note(pf, &hdr);
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_advance(pf, idx + 1);
+  spin_unlock_irq(&dev->rx_lock);
+  return rv;
+}
+
+/*
+ * only the primary reader holds the urbs back, so only it can lend
+ * slots to a pipe without them being overwritten; other readers and
+ * the other read modes get a copy.
+ */
+static ssize_t pqlabs_splice_read(struct file *file, loff_t *ppos,
+                                  struct pipe_inode_info *pipe, size_t len,
+                                  unsigned int flags)
+{
+  struct pqlabs_file *pf = file->private_data;
+  struct usb_pqlabs *dev = pf->dev;
+  bool nonblock = (file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+  ssize_t rv;
+
+  if (!dev->rx_ring || !len)
+    return 0;
+  if (READ_ONCE(dev->rx_primary) != pf || pf->latest ||
+      (pf->read_mode != PQLABS_READ_RAW && pf->read_mode != PQLABS_READ_STREAM))
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+    return generic_file_splice_read(file, ppos, pipe, len, flags);
+#else
+    return copy_splice_read(file, ppos, pipe, len, flags);
+#endif
+
+  if (dev->disconnecting)
+    return -ENODEV;
+
+  if (nonblock)
+  {
+    if (!mutex_trylock(&pf->read_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    rv = mutex_lock_interruptible(&pf->read_mutex);
+    if (rv < 0)
+      return rv;
+  }
+
+  do
+  {
+    rv = pqlabs_rx_wait(pf, nonblock);
+    if (rv < 0)
+      break;
+    rv = pqlabs_splice_slot(pf, pipe, len);
+  } while (rv == -ESTALE);
+
+  mutex_unlock(&pf->read_mutex);
+  return rv;
+}
+#endif
+
+static void pqlabs_write_bulk_callback(struct urb *urb)
+{
+	struct pqlabs_tx_urb *tx;
+	struct usb_pqlabs *dev;
+
+	tx = urb->context;
+	dev = tx->dev;
+
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+	/*
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN))
+			err("%s - nonzero write bulk status received: %d",
+			    __func__, urb->status);
+  */
+		spin_lock(&dev->err_lock);
+		dev->errors = urb->status;
+		spin_unlock(&dev->err_lock);
+		pqlabs_stat_error(dev, urb->status);
+	}
+	atomic64_inc(&dev->stats.tx_completed);
+	trace_pqlabs_tx_complete(dev->minor, urb->status, urb->actual_length,
+				 ktime_to_ns(ktime_sub(ktime_get(), tx->submitted)));
+
+	/* give the urb and its buffer back to the pool */
+	pqlabs_tx_put(tx);
+}
+
+/*
+ * pack the next MAX_TRANSFER bytes of the iterator into one pooled urb
+ * and send it. returns the number of bytes submitted.
+ */
+static ssize_t pqlabs_write_urb(struct usb_pqlabs *dev, struct iov_iter *from,
+				bool nonblock)
+{
+	struct pqlabs_tx_urb *tx;
+	size_t writesize = min(iov_iter_count(from), (size_t)MAX_TRANSFER);
+	ssize_t retval;
+
+	/*
+	 * limit the number of URBs in flight to the preallocated pool
+	 */
+	if (!nonblock) {
 		if (down_trylock(&dev->limit_sem)) {
-			retval = -EAGAIN;
-			goto exit;
+			atomic64_inc(&dev->stats.write_waits);
+			if (down_interruptible(&dev->limit_sem))
+				return -ERESTARTSYS;
 		}
+	} else {
+		if (down_trylock(&dev->limit_sem))
+			return -EAGAIN;
 	}
 
+	/* limit_sem guarantees a free urb */
+	tx = pqlabs_tx_get(dev);
+
+	if (!copy_from_iter_full(tx->buffer, writesize, from)) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	if (!nonblock) {
+		mutex_lock(&dev->io_mutex);
+	} else if (!mutex_trylock(&dev->io_mutex)) {
+		/* a reset holds it until the device is back */
+		retval = -EAGAIN;
+		goto error_revert;
+	}
+	if (!dev->interface) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error_revert;
+	}
+
+	/* initialize the urb properly */
+	usb_fill_bulk_urb(tx->urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  tx->buffer, writesize, pqlabs_write_bulk_callback, tx);
+	tx->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_anchor_urb(tx->urb, &dev->submitted);
+
+	/* send the data out the bulk port */
+	tx->submitted = ktime_get();
+	trace_pqlabs_tx_submit(dev->minor, writesize);
+	retval = usb_submit_urb(tx->urb, GFP_KERNEL);
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+//		err("%s - failed submitting write urb, error %d", __func__, retval);
+		goto error_unanchor;
+	}
+
+	atomic64_inc(&dev->stats.tx_submitted);
+	atomic64_add(writesize, &dev->stats.tx_bytes);
+	return writesize;
+
+error_unanchor:
+	usb_unanchor_urb(tx->urb);
+error_revert:
+	iov_iter_revert(from, writesize);
+error:
+	pqlabs_tx_put(tx);
+	return retval;
+}
+
+/*
+ * every segment of a writev() is packed back to back into as few urbs
+ * as possible; anything beyond MAX_TRANSFER continues in the next urb
+ * instead of being cut off.
+ */
+static ssize_t pqlabs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct pqlabs_file *pf;
+	struct usb_pqlabs *dev;
+	bool nonblock;
+	size_t written = 0;
+	ssize_t retval;
+
+	pf = (struct pqlabs_file *)file->private_data;
+	dev = pf->dev;
+	nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+	/* verify that we actually have some data to write */
+	if (!iov_iter_count(from))
+		return 0;
+
+	if (!dev->bulk_out_endpointAddr)
+		return -ENODEV;
+
 	spin_lock_irq(&dev->err_lock);
 	retval = dev->errors;
 	if (retval < 0) {
@@ -445,175 +2226,949 @@ static ssize_t pqlabs_write(struct file *file, const char *user_buffer, size_t c
 	}
 	spin_unlock_irq(&dev->err_lock);
 	if (retval < 0)
-		goto error;
+		return retval;
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
+	while (iov_iter_count(from)) {
+		retval = pqlabs_write_urb(dev, from, nonblock);
+		if (retval < 0)
+			break;
+		written += retval;
 	}
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
-	buf = usb_buffer_alloc
+
+	/* a partial write reports what went out, the error comes next time */
+	return written ? (ssize_t)written : retval;
+}
+
+/* sleep until a record is due by the capture clock. replay_mutex held */
+static int pqlabs_replay_pace(struct usb_pqlabs *dev, s64 ts)
+{
+  int speed = READ_ONCE(dev->replay_speed);
+  ktime_t due;
+
+  /* start over on the first record and when a capture loops */
+  if (!dev->replay_synced || ts < dev->replay_base_ts)
+  {
+    dev->replay_base_ts = ts;
+    dev->replay_base = ktime_get();
+    dev->replay_synced = true;
+    return 0;
+  }
+  if (!speed)
+    return 0;
+
+  due = ktime_add_ns(dev->replay_base, div_s64((ts - dev->replay_base_ts) * 100, speed));
+  while (ktime_before(ktime_get(), due))
+  {
+    set_current_state(TASK_INTERRUPTIBLE);
+    schedule_hrtimeout(&due, HRTIMER_MODE_ABS);
+    if (signal_pending(current))
+      return -ERESTARTSYS;
+  }
+  return 0;
+}
+
+/* room for one more slot, the primary reader holds the ring like urbs do */
+static bool pqlabs_replay_room(struct usb_pqlabs *dev)
+{
+  bool room;
+
+  spin_lock_irq(&dev->rx_lock);
+  pqlabs_rx_sync_tail(dev);
+  if (dev->rx_head - dev->rx_tail >= dev->rx_ring_size)
+    pqlabs_rx_drop_oldest(dev);
+  room = dev->rx_head - dev->rx_tail < dev->rx_ring_size &&
+         !pqlabs_rx_slot_lent(dev, &dev->rx_ring[dev->rx_head & (dev->rx_ring_size - 1)]);
+  spin_unlock_irq(&dev->rx_lock);
+  return room;
+}
+
+/* play one record: claim the next slot like an urb would and complete it */
+static int pqlabs_replay_record(struct usb_pqlabs *dev,
+                                const struct pqlabs_frame_header *hdr,
+                                struct iov_iter *from, bool nonblock)
+{
+  struct pqlabs_rx_slot *slot;
+  unsigned long idx;
+  ktime_t submitted;
+  int status = hdr->status;
+  bool wake;
+  int rv;
+
+  if (!pqlabs_replay_room(dev))
+  {
+    if (nonblock)
+      return -EAGAIN;
+    atomic64_inc(&dev->stats.write_waits);
+    rv = wait_event_interruptible(dev->bulk_out_wait,
+                                  pqlabs_replay_room(dev) || dev->disconnecting);
+    if (rv < 0)
+      return rv;
+    if (dev->disconnecting)
+      return -ENODEV;
+  }
+
+  spin_lock_irq(&dev->rx_lock);
+  idx = dev->rx_head++;
+  slot = &dev->rx_ring[idx & (dev->rx_ring_size - 1)];
+  slot->filled = 0;
+  slot->status = 0;
+  slot->ready = false;
+  spin_unlock_irq(&dev->rx_lock);
+
+  /* the slot is ours until it completes, as it would be an urb's */
+  submitted = ktime_get();
+  if (!copy_from_iter_full(slot->buffer, hdr->length, from))
+    status = -ESHUTDOWN;
+
+  spin_lock_irq(&dev->rx_lock);
+  wake = pqlabs_rx_complete(dev, idx, status, hdr->length, hdr->usb_frame, submitted);
+  spin_unlock_irq(&dev->rx_lock);
+
+  if (wake)
+    pqlabs_rx_wake(dev);
+  return status == -ESHUTDOWN ? -EFAULT : 0;
+}
+
+/*
+ * the replay device takes capture records on write() and hands each
+ * one to its readers as if it had just been received, paced by the
+ * capture timestamps. a full ring blocks the player like a device that
+ * NAKs; pacing always sleeps.
+ */
+static ssize_t pqlabs_replay_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct pqlabs_file *pf = iocb->ki_filp->private_data;
+  struct usb_pqlabs *dev = pf->dev;
+  bool nonblock = iocb->ki_filp->f_flags & O_NONBLOCK;
+  struct pqlabs_frame_header hdr;
+  ssize_t written = 0;
+  int rv;
+
+  rv = mutex_lock_interruptible(&dev->replay_mutex);
+  if (rv < 0)
+    return rv;
+
+  while (iov_iter_count(from))
+  {
+    /* whole records only */
+    rv = -EINVAL;
+    if (iov_iter_count(from) < sizeof(hdr))
+      break;
+    rv = -EFAULT;
+    if (!copy_from_iter_full(&hdr, sizeof(hdr), from))
+      break;
+    /*
+     * readers never see a positive status or a skipped slot, so a
+     * capture holds neither
+     */
+    rv = -EINVAL;
+    if (hdr.length > dev->bulk_in_size || hdr.length > iov_iter_count(from) ||
+        hdr.status > 0 || pqlabs_rx_unlinked(hdr.status))
+    {
+      iov_iter_revert(from, sizeof(hdr));
+      break;
+    }
+
+    rv = pqlabs_replay_pace(dev, hdr.timestamp_ns);
+    if (!rv)
+      rv = pqlabs_replay_record(dev, &hdr, from, nonblock);
+    if (rv < 0)
+    {
+      if (rv != -EFAULT)
+        iov_iter_revert(from, sizeof(hdr));
+      break;
+    }
+    written += sizeof(hdr) + hdr.length;
+  }
+
+  mutex_unlock(&dev->replay_mutex);
+  return written ? written : rv;
+}
+
+/*
+ * catch up with a reader of the mmap()ed ring: take its consumer index,
+ * restart parked urbs and wait up to timeout ms for a completed slot.
+ * returns the number of slots ready to be read.
+ */
+static long pqlabs_ring_wait(struct pqlabs_file *pf, int timeout)
+{
+  struct usb_pqlabs *dev = pf->dev;
+  long rv;
+
+  if (!dev->rx_ring)
+    return -ENODEV;
+
+  spin_lock_irq(&dev->rx_lock);
+  if (dev->rx_primary == pf)
+    pqlabs_rx_sync_tail(dev);
+  pqlabs_rx_refill(dev);
+  spin_unlock_irq(&dev->rx_lock);
+
+  if (timeout > 0 && !pqlabs_rx_pending(pf))
+  {
+    rv = wait_event_interruptible_timeout(dev->bulk_in_wait,
+                                          pqlabs_rx_pending(pf) || dev->disconnecting,
+                                          msecs_to_jiffies(timeout));
+    if (rv < 0)
+      return rv;
+  }
+
+  if (dev->disconnecting)
+    return -ENODEV;
+
+  return READ_ONCE(dev->rx_done) - pqlabs_rx_cursor(pf);
+}
+
+/* read string descriptor idx from the device, into a 256 byte buf */
+static int pqlabs_fetch_string(struct usb_device *udev, int idx, u8 *buf)
+{
+  int result = 0;
+  int i;
+
+  if (udev->state == USB_STATE_SUSPENDED)
+    return -EHOSTUNREACH;
+
+  for(i = 0; i < 3; i++)
+  {
+    result = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+                             USB_REQ_GET_DESCRIPTOR, USB_DIR_IN,
+                             (USB_DT_STRING << 8) + idx, 0x0409, buf, 255,
+                             USB_CTRL_GET_TIMEOUT);
+    if (result == 0 || result == -EPIPE)
+      continue;
+    if (result > 1 && buf[1] != USB_DT_STRING)
+    {
+      result = -ENODATA;
+      continue;
+    }
+    break;
+  }
+  if (result > 0)
+    result = buf[0];
+  return result;
+}
+
+/*
+ * string descriptor idx as the device sent it, returns bLength. the
+ * descriptors are read once and then come from the cache, so looking up
+ * a serial number does not put control transfers next to the stream.
+ * a string the device does not have is remembered as well. pin keeps the
+ * entry from being evicted.
+ */
+static int __pqlabs_get_string(struct usb_pqlabs *dev, int idx, u8 *buf,
+                               bool pin)
+{
+  struct pqlabs_string *str;
+  int result;
+  int i;
+
+  mutex_lock(&dev->string_mutex);
+  for (i = 0; i < PQLABS_MAX_STRINGS; i++)
+  {
+    str = &dev->strings[i];
+    if (str->index == idx)
+    {
+      str->pinned |= pin;
+      if (str->len > 0)
+        memcpy(buf, str->desc, sizeof(str->desc));
+      mutex_unlock(&dev->string_mutex);
+      return str->len;
+    }
+  }
+
+  result = pqlabs_fetch_string(dev->udev, idx, buf);
+  /* a stall or a bad descriptor is the answer, other errors may pass */
+  if (result >= 0 || result == -EPIPE || result == -ENODATA)
+  {
+    /* the strings read at probe stay, the others take turns */
+    for (i = 0; i < PQLABS_MAX_STRINGS; i++)
+    {
+      str = &dev->strings[dev->string_next++ % PQLABS_MAX_STRINGS];
+      if (str->pinned)
+        continue;
+      str->index = idx;
+      str->len = result;
+      str->pinned = pin;
+      if (result > 0)
+        memcpy(str->desc, buf, sizeof(str->desc));
+      break;
+    }
+  }
+  mutex_unlock(&dev->string_mutex);
+  return result;
+}
+
+static int pqlabs_get_string(struct usb_pqlabs *dev, int idx, u8 *buf)
+{
+  return __pqlabs_get_string(dev, idx, buf, false);
+}
+
+/* fill the cache with the strings the device descriptor names */
+static void pqlabs_cache_strings(struct usb_pqlabs *dev)
+{
+  const struct usb_device_descriptor *desc = &dev->udev->descriptor;
+  int idx[] = { 0, desc->iManufacturer, desc->iProduct, desc->iSerialNumber };
+  u8 *buf;
+  int i;
+
+  BUILD_BUG_ON(ARRAY_SIZE(idx) >= PQLABS_MAX_STRINGS);
+
+  mutex_lock(&dev->string_mutex);
+  for (i = 0; i < PQLABS_MAX_STRINGS; i++)
+  {
+    dev->strings[i].index = -1;
+    dev->strings[i].len = 0;
+    dev->strings[i].pinned = false;
+  }
+  dev->string_next = 0;
+  mutex_unlock(&dev->string_mutex);
+
+  buf = kzalloc(256, GFP_KERNEL);
+  if (!buf)
+    return;
+  for (i = 0; i < ARRAY_SIZE(idx); i++)
+    if (!i || idx[i])
+      __pqlabs_get_string(dev, idx[i], buf, true);
+  kfree(buf);
+}
+
+static long pqlabs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct usb_device *udev;
+  struct pqlabs_file *pf;
+  struct usb_pqlabs *dev;
+  int ret, result;
+  int len, idx;
+  char *buf;
+  void __user *user_arg = (void __user *)arg;
+
+  ret = 0;
+  len = 0;
+  pf = (struct pqlabs_file *)file->private_data;
+  dev = pf->dev;
+  udev = dev->udev;
+
+  if (cmd == USB_IOCTL_GET_STRING)
+  {
+    if (!udev)
+      return -ENODEV;
+    if (get_user(idx, (int __user *)user_arg))
+    {
+      printk("pqlabs: get idx failed!\n");
+      return -EFAULT;
+    }
+
+    if ((buf = kmalloc(256, GFP_KERNEL)) == NULL)
+      return -ENOMEM;
+
+    result = pqlabs_get_string(dev, idx, buf);
+    if (result > 0)
+    {
+      len = result;
+      if (copy_to_user(user_arg + sizeof(int), buf, len + 1))
+      {
+        kfree(buf);
+        return -EFAULT;
+      }
+    }
+    kfree(buf);
+    return result == -EHOSTUNREACH ? result : len;
+  }
+  else if (cmd == USB_IOCTL_SET_READ_MODE)
+  {
+    int mode;
+
+    if (get_user(mode, (int __user *)user_arg))
+      return -EFAULT;
+    if ((mode & ~PQLABS_READ_LATEST) != PQLABS_READ_RAW &&
+        (mode & ~PQLABS_READ_LATEST) != PQLABS_READ_FRAMES &&
+        mode != PQLABS_READ_STREAM && mode != PQLABS_READ_ALIGNED)
+      return -EINVAL;
+
+    spin_lock_irq(&dev->rx_lock);
+    pf->read_mode = mode & ~PQLABS_READ_LATEST;
+    pf->latest = mode & PQLABS_READ_LATEST;
+    spin_unlock_irq(&dev->rx_lock);
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_GET_FRAME_INFO)
+  {
+    if (copy_to_user(user_arg, &pf->last, sizeof(pf->last)))
+      return -EFAULT;
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_RING_WAIT)
+  {
+    int timeout;
+
+    if (get_user(timeout, (int __user *)user_arg))
+      return -EFAULT;
+
+    return pqlabs_ring_wait(pf, timeout);
+  }
+  else if (cmd == USB_IOCTL_REPLAY_SPEED)
+  {
+    int speed;
+
+    if (!dev->replay)
+      return -ENOTTY;
+    if (get_user(speed, (int __user *)user_arg))
+      return -EFAULT;
+    if (speed < 0)
+      return -EINVAL;
+
+    mutex_lock(&dev->replay_mutex);
+    dev->replay_speed = speed;
+    dev->replay_synced = false;
+    mutex_unlock(&dev->replay_mutex);
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_SET_READ_TIMEOUT)
+  {
+    __s64 timeout;
+
+    if (get_user(timeout, (__s64 __user *)user_arg))
+      return -EFAULT;
+    if (timeout < PQLABS_READ_TIMEOUT_FOREVER)
+      return -EINVAL;
+
+    /* takes effect with the next read() */
+    WRITE_ONCE(pf->read_timeout, timeout);
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_SET_IDLE_FILTER)
+  {
+    struct pqlabs_idle_filter filter;
+    bool admin;
+
+    if (copy_from_user(&filter, user_arg, sizeof(filter)))
+      return -EFAULT;
+    /* coalescing can not tell a touch without a signature */
+    if (filter.flags & ~(PQLABS_IDLE_DUPLICATES | PQLABS_IDLE_SIGNATURE) ||
+        filter.length > PQLABS_IDLE_SIGNATURE_MAX ||
+        filter.coalesce_us > USEC_PER_SEC ||
+        (filter.coalesce_us && !filter.length))
+      return -EINVAL;
+
+    /* it changes what every reader gets, so only the primary may */
+    admin = capable(CAP_SYS_ADMIN);
+    spin_lock_irq(&dev->rx_lock);
+    if (dev->rx_primary == pf || admin)
+      pqlabs_rx_set_idle(dev, &filter);
+    else
+      ret = -EPERM;
+    spin_unlock_irq(&dev->rx_lock);
+    return ret;
+  }
+  else if (cmd == USB_IOCTL_SET_BUSY_POLL)
+  {
+    int us;
+
+    if (get_user(us, (int __user *)user_arg))
+      return -EFAULT;
+    if (us < 0 || us > PQLABS_MAX_BUSY_POLL)
+      return -EINVAL;
+
+    WRITE_ONCE(pf->busy_poll, us);
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_GET_OVERRUNS)
+  {
+    u64 overruns;
+
+    spin_lock_irq(&dev->rx_lock);
+    overruns = pf->overruns;
+    spin_unlock_irq(&dev->rx_lock);
+
+    if (put_user(overruns, (__u64 __user *)user_arg))
+      return -EFAULT;
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_SET_PRIMARY)
+  {
+    int primary;
+
+    if (get_user(primary, (int __user *)user_arg))
+      return -EFAULT;
+    if (!dev->rx_ring || list_empty(&pf->list))
+      return -EINVAL;
+
+    /* not in the middle of a read() of this file */
+    if (mutex_lock_interruptible(&pf->read_mutex))
+      return -ERESTARTSYS;
+    spin_lock_irq(&dev->rx_lock);
+    ret = pqlabs_rx_set_primary(pf, primary);
+    spin_unlock_irq(&dev->rx_lock);
+    mutex_unlock(&pf->read_mutex);
+    return ret;
+  }
+  else if (cmd == USB_IOCTL_GET_SKIPPED)
+  {
+    u64 skipped;
+
+    spin_lock_irq(&dev->rx_lock);
+    skipped = pf->skipped;
+    spin_unlock_irq(&dev->rx_lock);
+
+    if (put_user(skipped, (__u64 __user *)user_arg))
+      return -EFAULT;
+    return 0;
+  }
+  else if (cmd == USB_IOCTL_CLEAR_FEATURE)
+  {
+    if (!udev)
+      return -ENODEV;
+    if (udev->state == USB_STATE_SUSPENDED)
+      return -EHOSTUNREACH;
+
+    {
+      char dBuf[8];
+      result = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+                               USB_REQ_CLEAR_FEATURE, USB_TYPE_STANDARD,
+	                       0, 0x82, dBuf, 8,
+                               USB_CTRL_GET_TIMEOUT);
+    }
+
+
+    return result;
+
+  }
+
+  return ret;
+
+}
+
+#if defined CONFIG_COMPAT
+static long pqlabs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  unsigned long translated_arg = (unsigned long)compat_ptr(arg);
+  return pqlabs_ioctl(file, cmd, translated_arg);
+}
+#endif
+
+/*
+ * readable once a transfer has completed, writable while a write urb
+ * is free. also restarts reception for readers of the mmap()ed ring.
+ */
+static __poll_t pqlabs_poll(struct file *file, poll_table *wait)
+{
+	struct pqlabs_file *pf;
+	struct usb_pqlabs *dev;
+	__poll_t mask = 0;
+
+	pf = (struct pqlabs_file *)file->private_data;
+	dev = pf->dev;
+
+	poll_wait(file, &dev->bulk_in_wait, wait);
+	poll_wait(file, &dev->bulk_out_wait, wait);
+
+	if (dev->disconnecting)
+		return EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR;
+
+	if (dev->rx_ring) {
+		spin_lock_irq(&dev->rx_lock);
+		if (dev->rx_primary == pf)
+			pqlabs_rx_sync_tail(dev);
+		pqlabs_rx_refill(dev);
+		spin_unlock_irq(&dev->rx_lock);
+
+		if (pqlabs_rx_pending(pf))
+			mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (dev->replay) {
+		if (pqlabs_replay_room(dev))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+	} else if (!down_trylock(&dev->limit_sem)) {
+		up(&dev->limit_sem);
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * map the ring header followed by every slot buffer. the kernel
+ * only ever reads the consumer index back from the mapping.
+ */
+static int pqlabs_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pqlabs_file *pf;
+	struct usb_pqlabs *dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long addr = vma->vm_start;
+	unsigned long slot_size, shared_size;
+	unsigned int i;
+	bool primary;
+	int rv;
+
+	pf = (struct pqlabs_file *)file->private_data;
+	dev = pf->dev;
+	if (!dev->rx_ring)
+		return -ENODEV;
+
+	slot_size = PAGE_SIZE << dev->rx_slot_order;
+	shared_size = PAGE_SIZE << dev->rx_shared_order;
+	if (vma->vm_pgoff ||
+	    size > shared_size + dev->rx_ring_size * slot_size)
+		return -EINVAL;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* only the primary writes consumer, everyone else maps read-only */
+	spin_lock_irq(&dev->rx_lock);
+	primary = dev->rx_primary == pf;
+	if (primary)
+		pf->mapped = true;
+	spin_unlock_irq(&dev->rx_lock);
+	if (!primary && (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	if (!primary)
+		vma->vm_flags &= ~VM_MAYWRITE;
 #else
-	buf = usb_alloc_coherent
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	if (!primary)
+		vm_flags_clear(vma, VM_MAYWRITE);
 #endif
-              (dev->udev, writesize, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+
+	rv = remap_pfn_range(vma, addr,
+			     virt_to_phys(dev->rx_shared) >> PAGE_SHIFT,
+			     min(shared_size, size), vma->vm_page_prot);
+	if (rv)
+		return rv;
+	addr += shared_size;
+
+	for (i = 0; i < dev->rx_ring_size && addr < vma->vm_end; i++) {
+		rv = remap_pfn_range(vma, addr,
+				     virt_to_phys(dev->rx_ring[i].buffer) >> PAGE_SHIFT,
+				     min(slot_size, vma->vm_end - addr),
+				     vma->vm_page_prot);
+		if (rv)
+			return rv;
+		addr += slot_size;
 	}
 
-	if (copy_from_user(buf, user_buffer, writesize)) {
-		retval = -EFAULT;
-		goto error;
+	return 0;
+}
+
+static void pqlabs_devices_add(struct usb_pqlabs *dev)
+{
+	if (!dev->rx_ring)
+		return;
+
+	mutex_lock(&pqlabs_devices_lock);
+	list_add_tail(&dev->node, &pqlabs_devices);
+	pqlabs_devices_gen++;
+	mutex_unlock(&pqlabs_devices_lock);
+	wake_up_interruptible(&pqlabs_aggregate_wait);
+}
+
+static void pqlabs_devices_del(struct usb_pqlabs *dev)
+{
+	mutex_lock(&pqlabs_devices_lock);
+	if (!list_empty(&dev->node)) {
+		list_del_init(&dev->node);
+		pqlabs_devices_gen++;
 	}
+	mutex_unlock(&pqlabs_devices_lock);
+	wake_up_interruptible(&pqlabs_aggregate_wait);
+}
 
-	/* this lock makes sure we don't submit URBs to gone devices */
-	mutex_lock(&dev->io_mutex);
-	if (!dev->interface) {		/* disconnect() was called */
-		mutex_unlock(&dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+/* what the aggregate node tags the transfers of dev with */
+static const char *pqlabs_serial(struct usb_pqlabs *dev)
+{
+	if (dev->replay)
+		return "replay";
+	return dev->udev->serial ? dev->udev->serial : "";
+}
 
-	/* initialize the urb properly */
-	usb_fill_bulk_urb(urb, dev->udev,
-			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-			  buf, writesize, pqlabs_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &dev->submitted);
+/* one device as read through the aggregate node */
+struct pqlabs_tap {
+	struct list_head        node;			/* on taps */
+	struct pqlabs_file      *pf;			/* our reader of the device */
+	unsigned long           idx;			/* its next slot, if ready */
+	bool                    ready;
+};
 
-	/* send the data out the bulk port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&dev->io_mutex);
-	if (retval) {
-//		err("%s - failed submitting write urb, error %d", __func__, retval);
-		goto error_unanchor;
+/* per open file state of the aggregate node */
+struct pqlabs_agg_file {
+	struct mutex            read_mutex;		/* one reader at a time */
+	struct list_head        taps;
+	unsigned int            gen;			/* pqlabs_devices_gen of taps */
+	u64                     overruns;		/* of taps already gone */
+};
+
+/* follow devices coming and going. read_mutex held */
+static void pqlabs_agg_sync(struct pqlabs_agg_file *af)
+{
+	struct pqlabs_tap *tap, *next;
+	struct usb_pqlabs *dev;
+	bool tapped;
+
+	if (READ_ONCE(pqlabs_devices_gen) == af->gen)
+		return;
+
+	mutex_lock(&pqlabs_devices_lock);
+	af->gen = pqlabs_devices_gen;
+
+	list_for_each_entry_safe(tap, next, &af->taps, node) {
+		if (!list_empty(&tap->pf->dev->node))
+			continue;
+		af->overruns += tap->pf->overruns;
+		list_del(&tap->node);
+		pqlabs_detach(tap->pf);
+		kfree(tap);
 	}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
+	list_for_each_entry(dev, &pqlabs_devices, node) {
+		tapped = false;
+		list_for_each_entry(tap, &af->taps, node)
+			tapped |= tap->pf->dev == dev;
+		if (tapped)
+			continue;
+
+		tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+		if (!tap)
+			break;
+		tap->pf = pqlabs_attach(dev, PQLABS_ATTACH_READER |
+					      PQLABS_ATTACH_TAP);
+		if (IS_ERR(tap->pf)) {
+			kfree(tap);
+			continue;
+		}
+		list_add_tail(&tap->node, &af->taps);
+	}
+	mutex_unlock(&pqlabs_devices_lock);
+}
 
+static bool pqlabs_agg_pending(struct pqlabs_agg_file *af)
+{
+	struct pqlabs_tap *tap;
 
-	return writesize;
+	list_for_each_entry(tap, &af->taps, node)
+		if (pqlabs_rx_pending(tap->pf))
+			return true;
+	return false;
+}
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
-                usb_buffer_free
-#else
-		usb_free_coherent
-#endif
-                  (dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+/*
+ * merge what the devices completed up to now, oldest first. anything
+ * completing later gets a later timestamp, so no record can arrive out
+ * of order in a later read. the cost per record is one pass over the
+ * taps.
+ */
+static ssize_t pqlabs_agg_merge(struct pqlabs_agg_file *af, struct iov_iter *to)
+{
+	struct pqlabs_aggregate_header ah;
+	struct pqlabs_tap *tap, *best;
+	struct pqlabs_rx_slot *slot;
+	struct usb_pqlabs *dev;
+	ktime_t limit = ktime_get();
+	ktime_t ts, best_ts = 0;
+	bool stale = false, full = false;
+	ssize_t copied = 0;
+
+	list_for_each_entry(tap, &af->taps, node)
+		tap->ready = pqlabs_rx_peek(tap->pf, &tap->idx);
+
+	for (;;) {
+		best = NULL;
+		list_for_each_entry(tap, &af->taps, node) {
+			if (!tap->ready)
+				continue;
+			dev = tap->pf->dev;
+			ts = dev->rx_ring[tap->idx & (dev->rx_ring_size - 1)].ts;
+			if (ktime_after(ts, limit))
+				continue;
+			if (!best || ktime_before(ts, best_ts)) {
+				best = tap;
+				best_ts = ts;
+			}
+		}
+		if (!best)
+			break;
+
+		dev = best->pf->dev;
+		slot = &dev->rx_ring[best->idx & (dev->rx_ring_size - 1)];
+		memset(&ah, 0, sizeof(ah));
+		pqlabs_rx_header(slot, &ah.frame);
+		if (sizeof(ah) + ah.frame.length > iov_iter_count(to)) {
+			full = true;
+			break;
+		}
+		strscpy(ah.serial, pqlabs_serial(dev), sizeof(ah.serial));
+		ah.minor = dev->minor;
+
+		if (copy_to_iter(&ah, sizeof(ah), to) != sizeof(ah) ||
+		    copy_to_iter(slot->buffer, ah.frame.length, to) != ah.frame.length) {
+			if (!copied)
+				copied = -EFAULT;
+			break;
+		}
+		if (pqlabs_rx_stale(best->pf, best->idx)) {
+			iov_iter_revert(to, sizeof(ah) + ah.frame.length);
+			stale = true;
+			break;
+		}
+		copied += sizeof(ah) + ah.frame.length;
+		pqlabs_file_note(best->pf, &ah.frame);
+
+		spin_lock_irq(&dev->rx_lock);
+		pqlabs_rx_advance(best->pf, best->idx + 1);
+		spin_unlock_irq(&dev->rx_lock);
+		best->ready = pqlabs_rx_peek(best->pf, &best->idx);
 	}
-	up(&dev->limit_sem);
 
-exit:
-	return retval;
+	/* not even the oldest record fits */
+	if (!copied)
+		copied = full && !stale ? -EMSGSIZE : -ESTALE;
+	return copied;
 }
 
-static long pqlabs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static ssize_t pqlabs_agg_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-  struct usb_device *udev;
-  struct usb_pqlabs *dev;
-  int ret, result;
-  int len, idx;
-  char *buf;
-  int i;
-  void __user *user_arg = (void __user *)arg;
+	struct file *file = iocb->ki_filp;
+	struct pqlabs_agg_file *af = file->private_data;
+	bool nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	struct pqlabs_tap *tap;
+	ssize_t rv;
 
-  ret = 0;
-  len = 0;
-  dev = (struct usb_pqlabs *)file->private_data;
-  udev = dev->udev;
+	if (!iov_iter_count(to))
+		return 0;
 
-  if (cmd == USB_IOCTL_GET_STRING)
-  {
-    if (get_user(idx, (int __user *)user_arg))
-    {
-      printk("pqlabs: get idx failed!\n");
-      return -EFAULT;
-    }
+	if (nonblock) {
+		if (!mutex_trylock(&af->read_mutex))
+			return -EAGAIN;
+	} else {
+		rv = mutex_lock_interruptible(&af->read_mutex);
+		if (rv < 0)
+			return rv;
+	}
 
-    if (udev->state == USB_STATE_SUSPENDED)
-      return -EHOSTUNREACH;
+	for (;;) {
+		pqlabs_agg_sync(af);
 
-    if ((buf = kmalloc(256, GFP_KERNEL)) == NULL)
-      return -ENOMEM;
+		/* resubmit urbs parked by an error or a suspend */
+		list_for_each_entry(tap, &af->taps, node) {
+			spin_lock_irq(&tap->pf->dev->rx_lock);
+			pqlabs_rx_refill(tap->pf->dev);
+			spin_unlock_irq(&tap->pf->dev->rx_lock);
+		}
 
-    for(i = 0; i < 3; i++)
-    {
-      result = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-                               USB_REQ_GET_DESCRIPTOR, USB_DIR_IN,
-	                       (USB_DT_STRING << 8) + idx, 0x0409, buf, 255,
-                               USB_CTRL_GET_TIMEOUT);
-      if (result == 0 || result == -EPIPE)
-        continue;
-      if (result > 1 && ((u8 *)buf)[1] != USB_DT_STRING)
-      {
-        result = -ENODATA;
-        continue;
-      }
-      break;
-    }
+		if (pqlabs_agg_pending(af)) {
+			rv = pqlabs_agg_merge(af, to);
+			if (rv != -ESTALE)
+				break;
+			continue;
+		}
 
-    if (result > 0)
-    {
-      len = buf[0];
-      if (copy_to_user(user_arg + sizeof(int), buf, len + 1))
-      {
-        kfree(buf);
-        return -EFAULT;
-      }
-    }
-    kfree(buf);
-    return len;
-  }
-  else if (cmd == USB_IOCTL_CLEAR_FEATURE)
-  {
-    if (udev->state == USB_STATE_SUSPENDED)
-      return -EHOSTUNREACH;
+		rv = -EAGAIN;
+		if (nonblock)
+			break;
+		rv = wait_event_interruptible(pqlabs_aggregate_wait,
+					      pqlabs_agg_pending(af) ||
+					      READ_ONCE(pqlabs_devices_gen) != af->gen);
+		if (rv < 0)
+			break;
+	}
 
-    {
-      char dBuf[8];
-      result = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
-                               USB_REQ_CLEAR_FEATURE, USB_TYPE_STANDARD,
-	                       0, 0x82, dBuf, 8,
-                               USB_CTRL_GET_TIMEOUT);
-    }
+	mutex_unlock(&af->read_mutex);
+	return rv;
+}
 
+static __poll_t pqlabs_agg_poll(struct file *file, poll_table *wait)
+{
+	struct pqlabs_agg_file *af = file->private_data;
+	__poll_t mask = 0;
 
-    return result;
+	poll_wait(file, &pqlabs_aggregate_wait, wait);
 
-  }
+	/* a blocked reader syncs for us */
+	if (mutex_trylock(&af->read_mutex)) {
+		pqlabs_agg_sync(af);
+		if (pqlabs_agg_pending(af))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		mutex_unlock(&af->read_mutex);
+	}
+	return mask;
+}
 
-  return ret;
+static long pqlabs_agg_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pqlabs_agg_file *af = file->private_data;
+	struct pqlabs_tap *tap;
+	u64 overruns;
+
+	if (cmd != USB_IOCTL_GET_OVERRUNS)
+		return -ENOTTY;
 
+	mutex_lock(&af->read_mutex);
+	overruns = af->overruns;
+	list_for_each_entry(tap, &af->taps, node)
+		overruns += READ_ONCE(tap->pf->overruns);
+	mutex_unlock(&af->read_mutex);
+
+	if (put_user(overruns, (__u64 __user *)arg))
+		return -EFAULT;
+	return 0;
 }
 
 #if defined CONFIG_COMPAT
-static long pqlabs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static long pqlabs_agg_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-  unsigned long translated_arg = (unsigned long)compat_ptr(arg);
-  return pqlabs_ioctl(file, cmd, translated_arg);
+	return pqlabs_agg_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
 }
 #endif
 
+static int pqlabs_agg_open(struct inode *inode, struct file *file)
+{
+	struct pqlabs_agg_file *af;
+
+	af = kzalloc(sizeof(*af), GFP_KERNEL);
+	if (!af)
+		return -ENOMEM;
+	mutex_init(&af->read_mutex);
+	INIT_LIST_HEAD(&af->taps);
+
+	/* start streaming on every device right away */
+	mutex_lock(&af->read_mutex);
+	af->gen = READ_ONCE(pqlabs_devices_gen) - 1;
+	pqlabs_agg_sync(af);
+	mutex_unlock(&af->read_mutex);
+
+	file->private_data = af;
+	pqlabs_set_nowait(file);
+	return 0;
+}
+
+static int pqlabs_agg_release(struct inode *inode, struct file *file)
+{
+	struct pqlabs_agg_file *af = file->private_data;
+	struct pqlabs_tap *tap, *next;
+
+	list_for_each_entry_safe(tap, next, &af->taps, node) {
+		pqlabs_detach(tap->pf);
+		kfree(tap);
+	}
+	kfree(af);
+	return 0;
+}
+
 static const struct file_operations pqlabs_fops = {
 	.owner =	THIS_MODULE,
-	.read =		pqlabs_read,
-	.write =	pqlabs_write,
+	.read_iter =	pqlabs_read_iter,
+	.write_iter =	pqlabs_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	.splice_read =	pqlabs_splice_read,
+#endif
 	.open =		pqlabs_open,
 	.release =	pqlabs_release,
 	.flush =	pqlabs_flush,
+	.poll =		pqlabs_poll,
+	.mmap =		pqlabs_mmap,
   .unlocked_ioctl = pqlabs_ioctl,
 #if defined CONFIG_COMPAT
   .compat_ioctl = pqlabs_compat_ioctl,
@@ -630,32 +3185,308 @@ static struct usb_class_driver pqlabs_class = {
 	.minor_base =	USB_pqlabs_MINOR_BASE,
 };
 
+/* the replay device shares everything but open and write */
+static const struct file_operations pqlabs_replay_fops = {
+	.owner =	THIS_MODULE,
+	.read_iter =	pqlabs_read_iter,
+	.write_iter =	pqlabs_replay_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	.splice_read =	pqlabs_splice_read,
+#endif
+	.open =		pqlabs_replay_open,
+	.release =	pqlabs_release,
+	.flush =	pqlabs_flush,
+	.poll =		pqlabs_poll,
+	.mmap =		pqlabs_mmap,
+  .unlocked_ioctl = pqlabs_ioctl,
+#if defined CONFIG_COMPAT
+  .compat_ioctl = pqlabs_compat_ioctl,
+#endif
+};
+
+static struct miscdevice pqlabs_replay_misc = {
+	.minor =	MISC_DYNAMIC_MINOR,
+	.name =		"pqlabs_replay",
+	.fops =		&pqlabs_replay_fops,
+};
+
+static const struct file_operations pqlabs_agg_fops = {
+	.owner =	THIS_MODULE,
+	.read_iter =	pqlabs_agg_read_iter,
+	.open =		pqlabs_agg_open,
+	.release =	pqlabs_agg_release,
+	.poll =		pqlabs_agg_poll,
+	.unlocked_ioctl = pqlabs_agg_ioctl,
+#if defined CONFIG_COMPAT
+	.compat_ioctl = pqlabs_agg_compat_ioctl,
+#endif
+};
+
+static struct miscdevice pqlabs_agg_misc = {
+	.minor =	MISC_DYNAMIC_MINOR,
+	.name =		"pqlabs_aggregate",
+	.fops =		&pqlabs_agg_fops,
+};
+
+/* the counters most useful to scripts, under statistics/ in sysfs */
+#define PQLABS_STAT_ATTR(name)						\
+static ssize_t name##_show(struct device *d,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_pqlabs *dev = usb_get_intfdata(to_usb_interface(d));	\
+									\
+	if (!dev)							\
+		return -ENODEV;						\
+	return sprintf(buf, "%lld\n",					\
+		       (long long)atomic64_read(&dev->stats.name));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+PQLABS_STAT_ATTR(rx_completed);
+PQLABS_STAT_ATTR(rx_bytes);
+PQLABS_STAT_ATTR(tx_bytes);
+PQLABS_STAT_ATTR(read_timeouts);
+PQLABS_STAT_ATTR(epipe_errors);
+PQLABS_STAT_ATTR(eio_errors);
+PQLABS_STAT_ATTR(write_waits);
+PQLABS_STAT_ATTR(rx_suppressed);
+PQLABS_STAT_ATTR(rx_coalesced);
+PQLABS_STAT_ATTR(input_errors);
+PQLABS_STAT_ATTR(busy_poll_hits);
+PQLABS_STAT_ATTR(busy_poll_misses);
+PQLABS_STAT_ATTR(resumes);
+
+static struct attribute *pqlabs_stats_attrs[] = {
+	&dev_attr_rx_completed.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_read_timeouts.attr,
+	&dev_attr_epipe_errors.attr,
+	&dev_attr_eio_errors.attr,
+	&dev_attr_write_waits.attr,
+	&dev_attr_rx_suppressed.attr,
+	&dev_attr_rx_coalesced.attr,
+	&dev_attr_input_errors.attr,
+	&dev_attr_busy_poll_hits.attr,
+	&dev_attr_busy_poll_misses.attr,
+	&dev_attr_resumes.attr,
+	NULL,
+};
+
+static const struct attribute_group pqlabs_stats_group = {
+	.name = "statistics",
+	.attrs = pqlabs_stats_attrs,
+};
+
+/* to map frames to screens without asking the device */
+static ssize_t serial_show(struct device *d, struct device_attribute *attr,
+			   char *buf)
+{
+	struct usb_pqlabs *dev = usb_get_intfdata(to_usb_interface(d));
+
+	if (!dev)
+		return -ENODEV;
+	return sprintf(buf, "%s\n", pqlabs_serial(dev));
+}
+static DEVICE_ATTR_RO(serial);
+
+static void pqlabs_stats_show_hist(struct seq_file *m, const char *name,
+				   atomic64_t *hist)
+{
+	unsigned int i;
+
+	seq_printf(m, "%s_us:\n", name);
+	for (i = 0; i < PQLABS_HIST_BUCKETS; i++) {
+		if (i == 0)
+			seq_printf(m, "  %10s", "0");
+		else if (i == PQLABS_HIST_BUCKETS - 1)
+			seq_printf(m, "  %9lu+", 1UL << (i - 1));
+		else
+			seq_printf(m, "  %10lu", 1UL << (i - 1));
+		seq_printf(m, " %lld\n", (long long)atomic64_read(&hist[i]));
+	}
+}
+
+/* everything, including the latency histograms, in debugfs */
+static int pqlabs_stats_show(struct seq_file *m, void *v)
+{
+	struct usb_pqlabs *dev = m->private;
+	struct pqlabs_stats *st = &dev->stats;
+
+#define PQLABS_SHOW(name) \
+	seq_printf(m, "%-16s %lld\n", #name, (long long)atomic64_read(&st->name))
+	PQLABS_SHOW(rx_submitted);
+	PQLABS_SHOW(rx_completed);
+	PQLABS_SHOW(rx_bytes);
+	PQLABS_SHOW(tx_submitted);
+	PQLABS_SHOW(tx_completed);
+	PQLABS_SHOW(tx_bytes);
+	PQLABS_SHOW(read_timeouts);
+	PQLABS_SHOW(urb_kills);
+	PQLABS_SHOW(epipe_errors);
+	PQLABS_SHOW(eio_errors);
+	PQLABS_SHOW(short_reads);
+	PQLABS_SHOW(write_waits);
+	PQLABS_SHOW(rx_overruns);
+	PQLABS_SHOW(rx_skipped);
+	PQLABS_SHOW(rx_suppressed);
+	PQLABS_SHOW(rx_coalesced);
+	PQLABS_SHOW(input_errors);
+	PQLABS_SHOW(busy_poll_hits);
+	PQLABS_SHOW(busy_poll_misses);
+	PQLABS_SHOW(resumes);
+#undef PQLABS_SHOW
+
+	pqlabs_stats_show_hist(m, "rx_latency", st->rx_latency);
+	pqlabs_stats_show_hist(m, "read_wait", st->read_wait);
+	pqlabs_stats_show_hist(m, "resume_latency", st->resume_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pqlabs_stats);
+
+/* a device with its locks and queues set up, but no buffers yet */
+static struct usb_pqlabs *pqlabs_dev_alloc(void)
+{
+	struct usb_pqlabs *dev;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return NULL;
+	kref_init(&dev->kref);
+	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+	mutex_init(&dev->io_mutex);
+	mutex_init(&dev->replay_mutex);
+	mutex_init(&dev->string_mutex);
+	INIT_LIST_HEAD(&dev->rx_readers);
+	INIT_LIST_HEAD(&dev->node);
+	spin_lock_init(&dev->err_lock);
+	spin_lock_init(&dev->rx_lock);
+	spin_lock_init(&dev->tx_lock);
+	INIT_LIST_HEAD(&dev->tx_free);
+	init_usb_anchor(&dev->submitted);
+	init_usb_anchor(&dev->rx_submitted);
+	init_waitqueue_head(&dev->bulk_in_wait);
+	init_waitqueue_head(&dev->bulk_out_wait);
+	INIT_DELAYED_WORK(&dev->rx_lent_work, pqlabs_rx_lent_retry);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+	hrtimer_init(&dev->rx_coalesce, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->rx_coalesce.function = pqlabs_rx_coalesced;
+#else
+	hrtimer_setup(&dev->rx_coalesce, pqlabs_rx_coalesced, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#endif
+	dev->replay_speed = 100;
+	return dev;
+}
+
+static const struct pqlabs_decoder *pqlabs_find_decoder(const char *key)
+{
+	unsigned int i;
+
+	if (!key || !*key)
+		return NULL;
+	for (i = 0; i < ARRAY_SIZE(pqlabs_decoders); i++)
+		if (!strcmp(pqlabs_decoders[i]->key, key))
+			return pqlabs_decoders[i];
+	pr_warn("pqlabs: no decoder %s for evdev\n", key);
+	return NULL;
+}
+
+/* reception runs while the input device is open, as for an open file */
+static int pqlabs_input_open(struct input_dev *input)
+{
+	struct usb_pqlabs *dev = input_get_drvdata(input);
+	struct pqlabs_file *pf;
+
+	pf = pqlabs_attach(dev, 0);
+	if (IS_ERR(pf))
+		return PTR_ERR(pf);
+	dev->input_file = pf;
+	return 0;
+}
+
+static void pqlabs_input_close(struct input_dev *input)
+{
+	struct usb_pqlabs *dev = input_get_drvdata(input);
+
+	pqlabs_detach(dev->input_file);
+	dev->input_file = NULL;
+}
+
+static int pqlabs_input_register(struct usb_pqlabs *dev,
+				 const struct pqlabs_decoder *decoder)
+{
+	struct input_dev *input;
+	int retval;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
+
+	usb_make_path(dev->udev, dev->input_phys, sizeof(dev->input_phys));
+	strlcat(dev->input_phys, "/input0", sizeof(dev->input_phys));
+	input->name = decoder->name;
+	input->phys = dev->input_phys;
+	usb_to_input_id(dev->udev, &input->id);
+	input->dev.parent = &dev->interface->dev;
+	input->open = pqlabs_input_open;
+	input->close = pqlabs_input_close;
+	input_set_drvdata(input, dev);
+
+	input_set_abs_params(input, ABS_MT_POSITION_X, 0, decoder->x_max, 0, 0);
+	input_set_abs_params(input, ABS_MT_POSITION_Y, 0, decoder->y_max, 0, 0);
+	retval = input_mt_init_slots(input, decoder->max_contacts,
+				     INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED);
+	if (!retval)
+		retval = input_register_device(input);
+	if (retval) {
+		input_free_device(input);
+		return retval;
+	}
+
+	spin_lock_irq(&dev->rx_lock);
+	dev->decoder = decoder;
+	dev->input = input;
+	spin_unlock_irq(&dev->rx_lock);
+	return 0;
+}
+
+/* the completion path stops reporting before the input device goes */
+static void pqlabs_input_unregister(struct usb_pqlabs *dev)
+{
+	struct input_dev *input = dev->input;
+
+	if (!input)
+		return;
+	spin_lock_irq(&dev->rx_lock);
+	dev->input = NULL;
+	spin_unlock_irq(&dev->rx_lock);
+	input_unregister_device(input);
+}
+
 static int pqlabs_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id)
 {
+	const struct pqlabs_decoder *decoder;
 	struct usb_pqlabs *dev;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
 	size_t buffer_size;
+	unsigned int maxp;
 	int i;
 	int retval = -ENOMEM;
 
 	/* allocate memory for our device state and initialize it */
-	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	dev = pqlabs_dev_alloc();
 	if (!dev) {
 		//err("Out of memory");
 		goto error;
 	}
-	kref_init(&dev->kref);
-	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
-	mutex_init(&dev->io_mutex);
-	spin_lock_init(&dev->err_lock);
-	init_usb_anchor(&dev->submitted);
-	init_completion(&dev->bulk_in_completion);
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
         dev->disconnecting = false;
+	pqlabs_cache_strings(dev);
 
 
 	/* set up the endpoint information */
@@ -667,17 +3498,18 @@ static int pqlabs_probe(struct usb_interface *interface,
 		if (!dev->bulk_in_endpointAddr &&
 		    usb_endpoint_is_bulk_in(endpoint)) {
 			/* we found a bulk in endpoint */
-			buffer_size = READ_USB_MAX_LENGTH; //le16_to_cpu(endpoint->wMaxPacketSize);
-			dev->bulk_in_size = buffer_size;
+			/* whole packets, so only the last one of a transfer is short */
+			maxp = usb_endpoint_maxp(endpoint);
+			if (!maxp)
+				maxp = 64;
+			buffer_size = rx_size ? rx_size : READ_USB_MAX_LENGTH;
+			buffer_size = clamp_t(size_t, buffer_size, maxp,
+					      rounddown(READ_USB_MAX_LENGTH, maxp));
+			dev->bulk_in_size = roundup(buffer_size, maxp);
 			dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-			dev->bulk_in_buffer = kmalloc(buffer_size, GFP_KERNEL);
-			if (!dev->bulk_in_buffer) {
-				//err("Could not allocate bulk_in_buffer");
-				goto error;
-			}
-			dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!dev->bulk_in_urb) {
-				//err("Could not allocate bulk_in_urb");
+			retval = pqlabs_rx_alloc(dev);
+			if (retval) {
+				//err("Could not allocate bulk-in urbs");
 				goto error;
 			}
 		}
@@ -686,6 +3518,11 @@ static int pqlabs_probe(struct usb_interface *interface,
 		    usb_endpoint_is_bulk_out(endpoint)) {
 			/* we found a bulk out endpoint */
 			dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
+			retval = pqlabs_tx_alloc(dev);
+			if (retval) {
+				//err("Could not allocate bulk-out urbs");
+				goto error;
+			}
 		}
 	}
 
@@ -700,6 +3537,31 @@ static int pqlabs_probe(struct usb_interface *interface,
 		usb_set_intfdata(interface, NULL);
 		goto error;
 	}
+	dev->minor = interface->minor - USB_pqlabs_MINOR_BASE;
+
+	if (autosuspend_delay >= 0)
+		pm_runtime_set_autosuspend_delay(&dev->udev->dev,
+						 autosuspend_delay);
+
+	if (sysfs_create_group(&interface->dev.kobj, &pqlabs_stats_group) ||
+	    device_create_file(&interface->dev, &dev_attr_serial))
+		dev_warn(&interface->dev, "could not create sysfs attributes\n");
+
+	dev->debugfs_dir = debugfs_create_dir(dev_name(&interface->dev),
+					      pqlabs_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev,
+			    &pqlabs_stats_fops);
+	pqlabs_devices_add(dev);
+
+	/* the char device works without it, so failing is not fatal */
+	decoder = pqlabs_find_decoder(evdev);
+	if (decoder && dev->rx_ring &&
+	    decoder->max_contacts <= PQLABS_MAX_CONTACTS) {
+		retval = pqlabs_input_register(dev, decoder);
+		if (retval)
+			dev_warn(&interface->dev,
+				 "could not register input device: %d\n", retval);
+	}
 
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
@@ -720,7 +3582,15 @@ static void pqlabs_disconnect(struct usb_interface *interface)
 	//int minor = interface->minor;
 
   dev = usb_get_intfdata(interface);
+  pqlabs_input_unregister(dev);
+  pqlabs_devices_del(dev);
   dev->disconnecting = true;
+  wake_up_interruptible_all(&dev->bulk_in_wait);
+  wake_up_interruptible_all(&dev->bulk_out_wait);
+
+	debugfs_remove_recursive(dev->debugfs_dir);
+	device_remove_file(&interface->dev, &dev_attr_serial);
+	sysfs_remove_group(&interface->dev.kobj, &pqlabs_stats_group);
 
 	mutex_lock(&dev->io_mutex);
 	usb_set_intfdata(interface, NULL);
@@ -732,6 +3602,8 @@ static void pqlabs_disconnect(struct usb_interface *interface)
  	dev->interface = NULL;
 	mutex_unlock(&dev->io_mutex);
 
+	if (dev->rx_ring)
+		pqlabs_rx_stop(dev);
 	usb_kill_anchored_urbs(&dev->submitted);
 
 	/* decrement our usage count */
@@ -747,7 +3619,9 @@ static void pqlabs_draw_down(struct usb_pqlabs *dev)
 	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&dev->submitted);
-	usb_kill_urb(dev->bulk_in_urb);
+	atomic64_inc(&dev->stats.urb_kills);
+	trace_pqlabs_urb_kill(dev->minor, PQLABS_KILL_DRAW_DOWN);
+	usb_kill_anchored_urbs(&dev->rx_submitted);
 }
 
 static int pqlabs_suspend(struct usb_interface *intf, pm_message_t message)
@@ -756,12 +3630,20 @@ static int pqlabs_suspend(struct usb_interface *intf, pm_message_t message)
 
 	if (!dev)
 		return 0;
+	trace_pqlabs_suspend(dev->minor);
+	pqlabs_rx_park(dev);
 	pqlabs_draw_down(dev);
 	return 0;
 }
 
 static int pqlabs_resume(struct usb_interface *intf)
 {
+	struct usb_pqlabs *dev = usb_get_intfdata(intf);
+
+	if (!dev)
+		return 0;
+	trace_pqlabs_resume(dev->minor);
+	pqlabs_rx_rearm(dev);
 	return 0;
 }
 
@@ -769,7 +3651,9 @@ static int pqlabs_pre_reset(struct usb_interface *intf)
 {
 	struct usb_pqlabs *dev = usb_get_intfdata(intf);
 
+	trace_pqlabs_pre_reset(dev->minor);
 	mutex_lock(&dev->io_mutex);
+	pqlabs_rx_park(dev);
 	pqlabs_draw_down(dev);
 
 	return 0;
@@ -779,8 +3663,12 @@ static int pqlabs_post_reset(struct usb_interface *intf)
 {
 	struct usb_pqlabs *dev = usb_get_intfdata(intf);
 
+	trace_pqlabs_post_reset(dev->minor);
+
 	/* we are sure no URBs are active - no locking needed */
 	dev->errors = -EPIPE;
+	pqlabs_cache_strings(dev);
+	pqlabs_rx_rearm(dev);
 	mutex_unlock(&dev->io_mutex);
 
 	return 0;
@@ -798,14 +3686,77 @@ static struct usb_driver pqlabs_driver = {
 	.supports_autosuspend = 1,
 };
 
+static int pqlabs_replay_create(void)
+{
+	struct usb_pqlabs *dev;
+	int retval;
+
+	dev = pqlabs_dev_alloc();
+	if (!dev)
+		return -ENOMEM;
+	dev->replay = true;
+	dev->minor = -1;
+	dev->bulk_in_size = READ_USB_MAX_LENGTH;
+	retval = pqlabs_rx_alloc(dev);
+	if (retval)
+		goto error;
+
+	pqlabs_replay_dev = dev;
+	retval = misc_register(&pqlabs_replay_misc);
+	if (retval) {
+		pqlabs_replay_dev = NULL;
+		goto error;
+	}
+
+	dev->debugfs_dir = debugfs_create_dir("replay", pqlabs_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev,
+			    &pqlabs_stats_fops);
+	pqlabs_devices_add(dev);
+	return 0;
+
+error:
+	kref_put(&dev->kref, pqlabs_delete);
+	return retval;
+}
+
+/* module exit, so no file is open any more */
+static void pqlabs_replay_destroy(void)
+{
+	struct usb_pqlabs *dev = pqlabs_replay_dev;
+
+	if (!dev)
+		return;
+	pqlabs_devices_del(dev);
+	debugfs_remove_recursive(dev->debugfs_dir);
+	misc_deregister(&pqlabs_replay_misc);
+	pqlabs_replay_dev = NULL;
+	kref_put(&dev->kref, pqlabs_delete);
+}
+
 #define CUR_DRIVER_VERSION		"14.07.01"
 
 static int __init usb_pqlabs_init(void)
 {
 	int result;
 
+	pqlabs_debugfs_root = debugfs_create_dir("usb_pqlabs", NULL);
+
 	/* register this driver with the USB subsystem */
 	result = usb_register(&pqlabs_driver);
+	if (!result && replay) {
+		result = pqlabs_replay_create();
+		if (result)
+			usb_deregister(&pqlabs_driver);
+	}
+	if (!result && aggregate) {
+		result = misc_register(&pqlabs_agg_misc);
+		if (result) {
+			pqlabs_replay_destroy();
+			usb_deregister(&pqlabs_driver);
+		}
+	}
+	if (result)
+		debugfs_remove_recursive(pqlabs_debugfs_root);
 	//if (result)
 		//printk("usb_register failed. Error number %d", result);
 
@@ -815,8 +3766,13 @@ static int __init usb_pqlabs_init(void)
 
 static void __exit usb_pqlabs_exit(void)
 {
+	if (aggregate)
+		misc_deregister(&pqlabs_agg_misc);
+	pqlabs_replay_destroy();
+
 	/* deregister this driver with the USB subsystem */
 	usb_deregister(&pqlabs_driver);
+	debugfs_remove_recursive(pqlabs_debugfs_root);
 }
 
 module_init(usb_pqlabs_init);
@@ -0,0 +1,278 @@
+/*
+ * usb_pqlabs.h - interface between the pqlabs_bulk driver and user space
+ *
+ * This file is shared by the kernel module and by programs that talk to
+ * /dev/pqlabs_bulk%d, so it only uses types from <linux/types.h>.
+ */
+#ifndef _USB_PQLABS_H
+#define _USB_PQLABS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct pqlabs_string_descriptor
+{
+  __s32 index;
+  char value[256];
+};
+
+#define USB_IOCTL_GET_STRING                 _IOR('Q', 0x04, struct pqlabs_string_descriptor)
+#define USB_IOCTL_CLEAR_FEATURE              _IOR('Q', 0x05, int)
+
+/*
+ * Metadata the driver keeps for every received transfer. It precedes
+ * each transfer in PQLABS_READ_FRAMES mode and describes each slot of
+ * the mmap()ed ring.
+ */
+struct pqlabs_frame_header
+{
+  __u32 length;		/* bytes of data following the header */
+  __s32 status;		/* 0 or the negative urb status */
+  __u64 sequence;	/* per-device transfer number */
+  __s64 timestamp_ns;	/* CLOCK_MONOTONIC time of completion */
+  __u32 usb_frame;	/* bus frame number at completion */
+  __u32 reserved;
+};
+
+/*
+ * Shared memory receive ring.
+ *
+ * mmap() of the device at offset 0 maps the ring header followed by the
+ * receive buffers. Slot i of the ring holds its transfer at
+ * data_offset + (i & (slot_count - 1)) * slot_size, and its metadata in
+ * desc[i & (slot_count - 1)].
+ *
+ * The driver advances producer once a transfer has completed; slots in
+ * [consumer, producer) may be read. The reader advances consumer when it
+ * is done with a slot, after which the driver may reuse it. This only
+ * holds for the primary reader, see USB_IOCTL_SET_PRIMARY, which has to
+ * claim the ring before it maps it. Any other file may only map the
+ * ring read-only, and without a primary that mapped the ring the driver
+ * ignores consumer and reuses the oldest slot when it needs room. If the ring
+ * fills up the driver stops receiving and sets PQLABS_RING_NEED_WAKEUP;
+ * the reader then has to call USB_IOCTL_RING_WAIT after advancing
+ * consumer so reception restarts.
+ *
+ * Slots with a non-zero status belong to transfers that failed or were
+ * cancelled (suspend, release) or that the idle filter dropped; skip
+ * those with status -ENOENT, -ECONNRESET, -ESHUTDOWN or -ENODATA. The
+ * driver moves consumer past such slots by itself when they are the
+ * oldest, so a reader must not assume consumer keeps the value it wrote.
+ */
+#define PQLABS_RING_MAGIC                    0x47525150	/* "PQRG" */
+#define PQLABS_RING_VERSION                  2
+
+#define PQLABS_RING_NEED_WAKEUP              0x0001
+
+struct pqlabs_ring_header
+{
+  __u32 magic;
+  __u32 version;
+  __u32 slot_count;	/* number of slots, a power of two */
+  __u32 slot_size;	/* distance between slots in the mapping */
+  __u32 data_offset;	/* offset of slot 0 in the mapping */
+  __u32 map_size;	/* size of the whole mapping */
+  __u32 flags;		/* PQLABS_RING_* */
+  __u32 reserved;
+  __u64 producer;	/* written by the driver */
+  __u64 consumer;	/* written by the reader */
+  struct pqlabs_frame_header desc[];
+};
+
+/* sync consumer, restart reception and wait up to arg ms for a slot */
+#define USB_IOCTL_RING_WAIT                  _IOW('Q', 0x06, int)
+
+/*
+ * Read formats, selected per open file with USB_IOCTL_SET_READ_MODE.
+ *
+ * PQLABS_READ_RAW returns one received transfer per read(), cut to the
+ * size of the buffer. This is the default.
+ *
+ * PQLABS_READ_FRAMES returns as many received transfers as fit in the
+ * buffer (read() or readv()), each preceded by a struct
+ * pqlabs_frame_header. A transfer that failed has a negative status and
+ * no data. If the oldest transfer does not fit, read() fails with
+ * EMSGSIZE.
+ *
+ * PQLABS_READ_STREAM returns the received data as one byte stream. A
+ * transfer the buffer has no room for is continued by the next read(),
+ * nothing is dropped.
+ *
+ * PQLABS_READ_ALIGNED returns exactly one device frame per read(). A
+ * frame is joined from transfers up to the first short one, so it may
+ * be larger than the rx_size module parameter. If it does not fit,
+ * read() fails with EMSGSIZE.
+ *
+ * A failed transfer makes read() fail with EPIPE or EIO in every mode
+ * but PQLABS_READ_FRAMES.
+ *
+ * splice() from the device returns data as PQLABS_READ_STREAM does.
+ * For the primary reader in PQLABS_READ_RAW or PQLABS_READ_STREAM
+ * mode, the pipe gets the receive buffers themselves, not a copy. A
+ * buffer is not reused until the pipe, and anything the pipe passed it
+ * on to such as a socket, has released it. Reception stalls meanwhile.
+ */
+#define PQLABS_READ_RAW                      0
+#define PQLABS_READ_FRAMES                   1
+#define PQLABS_READ_STREAM                   2
+#define PQLABS_READ_ALIGNED                  3
+
+/*
+ * Or'ed into PQLABS_READ_RAW or PQLABS_READ_FRAMES: latest mode. The
+ * file only ever gets the newest successful transfer, one per read();
+ * older ones it did not get to are passed over and counted, see
+ * USB_IOCTL_GET_SKIPPED. A primary reader in latest mode no longer
+ * stops reception when it falls behind.
+ */
+#define PQLABS_READ_LATEST                   0x100
+
+#define USB_IOCTL_SET_READ_MODE              _IOW('Q', 0x07, int)
+
+/* what the last read() on this file returned */
+struct pqlabs_frame_info
+{
+  struct pqlabs_frame_header frame;	/* the newest transfer returned */
+  __s64 read_ns;	/* CLOCK_MONOTONIC time it was returned */
+  __u64 missed;		/* sequence numbers this file never saw */
+};
+
+#define USB_IOCTL_GET_FRAME_INFO             _IOR('Q', 0x08, struct pqlabs_frame_info)
+
+/*
+ * Several files may read the device at once. Each reads from its own
+ * position and never holds reception back; transfers it is too slow for
+ * are dropped, and USB_IOCTL_GET_OVERRUNS returns how many.
+ *
+ * A reader that must not lose transfers, normally pqmtpdaemon, claims
+ * the ring with USB_IOCTL_SET_PRIMARY and a non-zero arg. Reception then
+ * stops while it is behind, and only its consumer index counts in the
+ * mmap()ed header. There is one primary at a time, a second claim fails
+ * with EBUSY. Nobody takes over when the primary gives up (arg 0) or
+ * closes.
+ */
+#define USB_IOCTL_GET_OVERRUNS               _IOR('Q', 0x09, __u64)
+#define USB_IOCTL_SET_PRIMARY                _IOW('Q', 0x0f, int)
+
+/*
+ * Capture files.
+ *
+ * A capture is a struct pqlabs_capture_header followed by records
+ * exactly as PQLABS_READ_FRAMES returns them: a struct
+ * pqlabs_frame_header and length bytes of data each. Any extra reader
+ * of /dev/pqlabs_bulk%d in PQLABS_READ_FRAMES mode therefore taps the
+ * live traffic without slowing down the primary reader.
+ *
+ * With the module parameter replay=1 the driver also creates
+ * /dev/pqlabs_replay. It takes the same records on write() and hands
+ * them to its readers through the normal read path, spaced as their
+ * timestamps say. A primary reader that is behind blocks the writer.
+ * Open it write-only to play, so the player does not count as a reader.
+ * Sequence numbers, timestamps and statistics are those of the replay
+ * device. write() fails with EINVAL at a record with a positive status
+ * or one that read() would have skipped (-ENOENT, -ECONNRESET,
+ * -ESHUTDOWN, -ENODATA).
+ */
+#define PQLABS_CAPTURE_MAGIC                 0x50435150	/* "PQCP" */
+#define PQLABS_CAPTURE_VERSION               1
+
+struct pqlabs_capture_header
+{
+  __u32 magic;
+  __u32 version;
+  __u32 header_size;	/* offset of the first record */
+  __u32 reserved;
+  __s64 start_realtime_ns;	/* CLOCK_REALTIME when the capture started */
+  __s64 start_monotonic_ns;	/* the same moment in record timestamps */
+};
+
+/* playback speed in percent of the original, 0 for as fast as read */
+#define USB_IOCTL_REPLAY_SPEED               _IOW('Q', 0x0a, int)
+
+/*
+ * Aggregate node.
+ *
+ * With the module parameter aggregate=1 the driver creates
+ * /dev/pqlabs_aggregate. A read() returns the transfers of every bound
+ * device, and of the replay device, merged in timestamp order. Each one
+ * is preceded by a struct pqlabs_aggregate_header. As in
+ * PQLABS_READ_FRAMES, a read() returns as many records as fit and fails
+ * with EMSGSIZE if the oldest does not fit. It blocks until there is a
+ * record, with no timeout. The node reads each device as a reader that
+ * can never become the primary, so it never holds reception back; see
+ * USB_IOCTL_GET_OVERRUNS, which also works on it.
+ */
+struct pqlabs_aggregate_header
+{
+  struct pqlabs_frame_header frame;
+  char serial[24];	/* serial number of the source, NUL terminated */
+  __s32 minor;		/* N of its /dev/pqlabs_bulkN, -1 for replay */
+  __u32 reserved;
+};
+
+/*
+ * How long a read() of this file waits for a transfer, in nanoseconds.
+ * The default is one second, after which read() returns -1 as it always
+ * has; the receive urbs stay queued. PQLABS_READ_TIMEOUT_NONE makes
+ * read() fail with EAGAIN when nothing is there, as with O_NONBLOCK,
+ * and PQLABS_READ_TIMEOUT_FOREVER waits until a transfer arrives or a
+ * signal interrupts it. So does a timeout too long to be represented as
+ * a CLOCK_MONOTONIC deadline.
+ */
+#define PQLABS_READ_TIMEOUT_FOREVER          (-1)
+#define PQLABS_READ_TIMEOUT_NONE             0
+
+#define USB_IOCTL_SET_READ_TIMEOUT           _IOW('Q', 0x0b, __s64)
+
+/* transfers this file passed over in PQLABS_READ_LATEST mode */
+#define USB_IOCTL_GET_SKIPPED                _IOR('Q', 0x0c, __u64)
+
+/*
+ * Busy polling: a blocking read() of this file first spins for up to
+ * arg microseconds (at most 10000) checking for a transfer before it
+ * sleeps, which saves the wakeup latency at the cost of cpu time. 0, the
+ * default, turns it off. The statistics count busy_poll_hits and
+ * busy_poll_misses.
+ */
+#define USB_IOCTL_SET_BUSY_POLL              _IOW('Q', 0x0d, int)
+
+/*
+ * Idle filter, for every reader of the device. An idle frame keeps
+ * reporting the same empty scan; it is told apart by its first length
+ * bytes, which must equal signature wherever mask is set.
+ *
+ * PQLABS_IDLE_DUPLICATES drops a transfer that is byte for byte the one
+ * before it. PQLABS_IDLE_SIGNATURE drops idle transfers after the first,
+ * which still goes through so the reader sees every contact lift.
+ * Dropped transfers are counted in rx_suppressed and never reach a
+ * reader, in the mmap()ed ring their slots have status -ENODATA.
+ *
+ * coalesce_us, if not 0, defers the wakeup of the readers by up to that
+ * long (at most one second) while nobody touches the frame, so a few
+ * transfers are taken per wakeup. It needs length set, otherwise
+ * USB_IOCTL_SET_IDLE_FILTER fails with EINVAL: a transfer that does not
+ * match the signature counts as a touch and readers are woken for every
+ * transfer until 250 ms after the last one. Passing a zeroed
+ * struct turns everything off, which is the default.
+ *
+ * Only the primary reader, see USB_IOCTL_SET_PRIMARY, or a caller with
+ * CAP_SYS_ADMIN may set the filter, anyone else gets EPERM. The filter
+ * is cleared again when the last file of the device closes.
+ */
+#define PQLABS_IDLE_DUPLICATES               0x0001
+#define PQLABS_IDLE_SIGNATURE                0x0002
+
+#define PQLABS_IDLE_SIGNATURE_MAX            32
+
+struct pqlabs_idle_filter
+{
+  __u32 flags;		/* PQLABS_IDLE_* */
+  __u32 coalesce_us;	/* longest deferred wakeup while idle */
+  __u32 length;		/* bytes of signature and mask used */
+  __u32 reserved;
+  __u8 signature[PQLABS_IDLE_SIGNATURE_MAX];
+  __u8 mask[PQLABS_IDLE_SIGNATURE_MAX];
+};
+
+#define USB_IOCTL_SET_IDLE_FILTER            _IOW('Q', 0x0e, struct pqlabs_idle_filter)
+
+#endif /* _USB_PQLABS_H */
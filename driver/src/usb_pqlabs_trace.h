@@ -0,0 +1,201 @@
+/*
+ * usb_pqlabs_trace.h - tracepoints of the pqlabs_bulk driver
+ *
+ * All events carry the node number of /dev/pqlabs_bulk%d as minor, -1
+ * for the replay device.
+ * Latencies are in nanoseconds. See driver/tools/trace for scripts
+ * built on these events.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pqlabs
+
+#if !defined(_USB_PQLABS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USB_PQLABS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifndef _USB_PQLABS_TRACE_ENUMS
+#define _USB_PQLABS_TRACE_ENUMS
+/* why the driver cancelled its urbs */
+enum pqlabs_kill_reason {
+	PQLABS_KILL_STOP,		/* last release or disconnect */
+	PQLABS_KILL_DRAW_DOWN,		/* suspend or reset */
+	PQLABS_KILL_FLUSH,		/* writes still pending at close */
+};
+#endif
+
+/* export the values so perf and trace-cmd can resolve __print_symbolic() */
+TRACE_DEFINE_ENUM(PQLABS_KILL_STOP);
+TRACE_DEFINE_ENUM(PQLABS_KILL_DRAW_DOWN);
+TRACE_DEFINE_ENUM(PQLABS_KILL_FLUSH);
+
+TRACE_EVENT(pqlabs_rx_submit,
+	TP_PROTO(int minor, unsigned long slot, u32 length),
+	TP_ARGS(minor, slot, length),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned long, slot)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->slot = slot;
+		__entry->length = length;
+	),
+	TP_printk("minor=%d slot=%lu length=%u",
+		  __entry->minor, __entry->slot, __entry->length)
+);
+
+TRACE_EVENT(pqlabs_rx_complete,
+	TP_PROTO(int minor, unsigned long slot, int status, u32 actual,
+		 u64 seq, s64 latency_ns),
+	TP_ARGS(minor, slot, status, actual, seq, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned long, slot)
+		__field(int, status)
+		__field(u32, actual)
+		__field(u64, seq)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->slot = slot;
+		__entry->status = status;
+		__entry->actual = actual;
+		__entry->seq = seq;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("minor=%d slot=%lu status=%d actual=%u seq=%llu latency_ns=%lld",
+		  __entry->minor, __entry->slot, __entry->status,
+		  __entry->actual, __entry->seq, __entry->latency_ns)
+);
+
+TRACE_EVENT(pqlabs_read_timeout,
+	TP_PROTO(int minor, s64 waited_ns),
+	TP_ARGS(minor, waited_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(s64, waited_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->waited_ns = waited_ns;
+	),
+	TP_printk("minor=%d waited_ns=%lld",
+		  __entry->minor, __entry->waited_ns)
+);
+
+TRACE_EVENT(pqlabs_urb_kill,
+	TP_PROTO(int minor, int reason),
+	TP_ARGS(minor, reason),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, reason)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->reason = reason;
+	),
+	TP_printk("minor=%d reason=%s", __entry->minor,
+		  __print_symbolic(__entry->reason,
+				   { PQLABS_KILL_STOP, "stop" },
+				   { PQLABS_KILL_DRAW_DOWN, "draw_down" },
+				   { PQLABS_KILL_FLUSH, "flush" }))
+);
+
+/* a received transfer handed to user space; latency since completion */
+TRACE_EVENT(pqlabs_copy_to_user,
+	TP_PROTO(int minor, u64 seq, u32 length, s64 latency_ns),
+	TP_ARGS(minor, seq, length, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u64, seq)
+		__field(u32, length)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->seq = seq;
+		__entry->length = length;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("minor=%d seq=%llu length=%u latency_ns=%lld",
+		  __entry->minor, __entry->seq, __entry->length,
+		  __entry->latency_ns)
+);
+
+TRACE_EVENT(pqlabs_tx_submit,
+	TP_PROTO(int minor, u32 length),
+	TP_ARGS(minor, length),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->length = length;
+	),
+	TP_printk("minor=%d length=%u", __entry->minor, __entry->length)
+);
+
+TRACE_EVENT(pqlabs_tx_complete,
+	TP_PROTO(int minor, int status, u32 length, s64 latency_ns),
+	TP_ARGS(minor, status, length, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, status)
+		__field(u32, length)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->status = status;
+		__entry->length = length;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("minor=%d status=%d length=%u latency_ns=%lld",
+		  __entry->minor, __entry->status, __entry->length,
+		  __entry->latency_ns)
+);
+
+DECLARE_EVENT_CLASS(pqlabs_pm,
+	TP_PROTO(int minor),
+	TP_ARGS(minor),
+	TP_STRUCT__entry(
+		__field(int, minor)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+	TP_printk("minor=%d", __entry->minor)
+);
+
+DEFINE_EVENT(pqlabs_pm, pqlabs_suspend,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(pqlabs_pm, pqlabs_resume,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(pqlabs_pm, pqlabs_pre_reset,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(pqlabs_pm, pqlabs_post_reset,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+#endif /* _USB_PQLABS_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usb_pqlabs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,246 @@
+/*
+ * pqlabs_bench - read throughput and latency of /dev/pqlabs_bulk%d
+ *
+ * Reads for a fixed time and reports, one "name value" per line so CI
+ * can diff runs:
+ *
+ *   frames_per_s, mb_per_s       what the reader got
+ *   latency_p50/p99/p999_us      driver completion to read() return
+ *   e2e_p50/p99/p999_us          pqlabs_emu send to read() return
+ *   syscalls_per_frame           calls this tool made per frame
+ *   cpu_us_per_frame             user+sys time of this tool per frame
+ *   system_cpu_us_per_frame      busy time of all CPUs per frame
+ *
+ *   pqlabs_bench [-t seconds] [-m raw|frames] [-b bytes] [-p] device
+ *
+ * -p waits in poll() before every read.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "usb_pqlabs.h"
+#include "pqlabs_emu.h"
+
+struct samples {
+	long long *v;
+	size_t n, size;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sample_add(struct samples *s, long long v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (!s->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_percentiles(const char *name, struct samples *s)
+{
+	static const struct { const char *suffix; double q; } pct[] = {
+		{ "p50", 0.50 }, { "p99", 0.99 }, { "p999", 0.999 },
+	};
+	size_t i;
+
+	if (!s->n)
+		return;
+	qsort(s->v, s->n, sizeof(*s->v), cmp_ll);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf("%s_%s_us %.1f\n", name, pct[i].suffix,
+		       s->v[(size_t)(pct[i].q * (s->n - 1))] / 1000.0);
+}
+
+/* busy jiffies of all CPUs from /proc/stat */
+static long long system_busy_ticks(void)
+{
+	unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+	FILE *f = fopen("/proc/stat", "r");
+	int n;
+
+	if (!f)
+		return -1;
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu",
+		   &user, &nice, &sys, &idle, &iowait, &irq, &softirq);
+	fclose(f);
+	if (n != 7)
+		return -1;
+	return user + nice + sys + irq + softirq;
+}
+
+static long long self_cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+/* the emulator stamps its frames, anything else has no send time */
+static void note_payload(struct samples *e2e, const void *data, size_t len,
+			 long long read_ns)
+{
+	const struct pqlabs_emu_frame *f = data;
+
+	if (len >= sizeof(*f) && f->tag == PQLABS_EMU_TAG)
+		sample_add(e2e, read_ns - (long long)f->sent_ns);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pqlabs_bench [-t seconds] [-m raw|frames] [-b bytes] [-p] device\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct samples latency = { 0 }, e2e = { 0 };
+	long long frames = 0, bytes = 0, syscalls = 0;
+	long long start, end, read_ns, cpu0, ticks0, ticks1;
+	int seconds = 10, mode = PQLABS_READ_FRAMES, use_poll = 0, primary = 1;
+	size_t bufsize = 256 * 1024;
+	struct pollfd pfd;
+	char *buf;
+	ssize_t n;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "t:m:b:p")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "raw"))
+				mode = PQLABS_READ_RAW;
+			else if (!strcmp(optarg, "frames"))
+				mode = PQLABS_READ_FRAMES;
+			else
+				usage();
+			break;
+		case 'b':
+			bufsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			use_poll = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(fd, USB_IOCTL_SET_READ_MODE, &mode) < 0) {
+		perror("USB_IOCTL_SET_READ_MODE");
+		return 1;
+	}
+	/* stand in for the daemon, which reads as the primary */
+	if (ioctl(fd, USB_IOCTL_SET_PRIMARY, &primary) < 0)
+		perror("USB_IOCTL_SET_PRIMARY");
+	/* one transfer per read() can not exceed this in raw mode */
+	if (mode == PQLABS_READ_RAW && bufsize > 64 * 1024)
+		bufsize = 64 * 1024;
+	buf = malloc(bufsize);
+	if (!buf)
+		return 1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	ticks0 = system_busy_ticks();
+	cpu0 = self_cpu_ns();
+	start = now_ns();
+	end = start + seconds * 1000000000LL;
+
+	while (now_ns() < end) {
+		if (use_poll) {
+			syscalls++;
+			if (poll(&pfd, 1, 1000) <= 0)
+				continue;
+		}
+		syscalls++;
+		n = read(fd, buf, bufsize);
+		read_ns = now_ns();
+		if (n < 0) {
+			/* the driver reports a read timeout as -1 */
+			if (errno == EINTR || errno == EPERM)
+				continue;
+			perror("read");
+			return 1;
+		}
+
+		if (mode == PQLABS_READ_FRAMES) {
+			for (ssize_t off = 0; off < n;) {
+				struct pqlabs_frame_header *f = (void *)(buf + off);
+
+				if (!f->status) {
+					sample_add(&latency, read_ns - f->timestamp_ns);
+					note_payload(&e2e, f + 1, f->length, read_ns);
+					bytes += f->length;
+					frames++;
+				}
+				off += sizeof(*f) + f->length;
+			}
+		} else {
+			struct pqlabs_frame_info info;
+
+			syscalls++;
+			if (!ioctl(fd, USB_IOCTL_GET_FRAME_INFO, &info))
+				sample_add(&latency, read_ns - info.frame.timestamp_ns);
+			note_payload(&e2e, buf, n, read_ns);
+			bytes += n;
+			frames++;
+		}
+	}
+
+	end = now_ns();
+	ticks1 = system_busy_ticks();
+	printf("seconds %.3f\n", (end - start) / 1e9);
+	printf("frames %lld\n", frames);
+	printf("frames_per_s %.1f\n", frames * 1e9 / (end - start));
+	printf("mb_per_s %.3f\n", bytes * 1e3 / (end - start));
+	report_percentiles("latency", &latency);
+	report_percentiles("e2e", &e2e);
+	if (frames) {
+		printf("syscalls_per_frame %.3f\n", (double)syscalls / frames);
+		printf("cpu_us_per_frame %.3f\n",
+		       (self_cpu_ns() - cpu0) / 1e3 / frames);
+		if (ticks0 >= 0 && ticks1 >= 0)
+			printf("system_cpu_us_per_frame %.3f\n",
+			       (ticks1 - ticks0) * 1e6 / sysconf(_SC_CLK_TCK) / frames);
+	}
+
+	close(fd);
+	return 0;
+}
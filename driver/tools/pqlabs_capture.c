@@ -0,0 +1,148 @@
+/*
+ * pqlabs_capture - record the bulk-in traffic of a PQLabs frame
+ *
+ * Opens the device as an additional reader, so pqmtpdaemon keeps
+ * running, and writes every received transfer to a capture file (see
+ * usb_pqlabs.h). Stops after the given number of seconds or on Ctrl-C.
+ *
+ *   pqlabs_capture [-t seconds] /dev/pqlabs_bulk0 out.pqcap
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "usb_pqlabs.h"
+
+#define BUFFER_SIZE	(256 * 1024)
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pqlabs_capture [-t seconds] device file\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct pqlabs_capture_header hdr;
+	long long frames = 0, bytes = 0, deadline = 0;
+	__u64 overruns = 0;
+	int mode = PQLABS_READ_FRAMES;
+	int dev, out, opt;
+	char *buf;
+	ssize_t n;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			deadline = now_ns(CLOCK_MONOTONIC) +
+				   atoll(optarg) * 1000000000LL;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	dev = open(argv[optind], O_RDONLY);
+	if (dev < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(dev, USB_IOCTL_SET_READ_MODE, &mode) < 0) {
+		perror("USB_IOCTL_SET_READ_MODE");
+		return 1;
+	}
+	out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	buf = malloc(BUFFER_SIZE);
+	if (!buf)
+		return 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PQLABS_CAPTURE_MAGIC;
+	hdr.version = PQLABS_CAPTURE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.start_realtime_ns = now_ns(CLOCK_REALTIME);
+	hdr.start_monotonic_ns = now_ns(CLOCK_MONOTONIC);
+	if (write_all(out, &hdr, sizeof(hdr)) < 0) {
+		perror("write");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop && (!deadline || now_ns(CLOCK_MONOTONIC) < deadline)) {
+		n = read(dev, buf, BUFFER_SIZE);
+		if (n < 0) {
+			/* the driver reports a read timeout as -1 */
+			if (errno == EINTR || errno == EPERM)
+				continue;
+			perror("read");
+			break;
+		}
+		if (write_all(out, buf, n) < 0) {
+			perror("write");
+			break;
+		}
+		for (ssize_t off = 0; off < n;) {
+			struct pqlabs_frame_header *f = (void *)(buf + off);
+
+			off += sizeof(*f) + f->length;
+			bytes += f->length;
+			frames++;
+		}
+	}
+
+	ioctl(dev, USB_IOCTL_GET_OVERRUNS, &overruns);
+	fprintf(stderr, "%lld frames, %lld bytes, %llu lost to overruns\n",
+		frames, bytes, (unsigned long long)overruns);
+
+	close(out);
+	close(dev);
+	return 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * pqlabs_emu - emulate a PQLabs frame with raw-gadget on dummy_hcd
+ *
+ * Presents VID 0x1EF1 with PID 0x0001 (or 0x0011) and the vendor-class
+ * interface with one bulk-in and one bulk-out endpoint that
+ * pqlabs_table matches, then sends synthetic touch frames (see
+ * pqlabs_emu.h) at a fixed rate. Writes from the host are read and
+ * dropped.
+ *
+ *   modprobe dummy_hcd raw_gadget
+ *   pqlabs_emu [-p pid] [-r frames/s] [-s bytes] [-c contacts] [-n frames]
+ *
+ * -r 0 sends as fast as the host reads.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "pqlabs_emu.h"
+
+#define EMU_VENDOR_ID		0x1EF1
+#define EMU_MAX_PACKET		512
+#define EMU_EP0_MAX		255
+#define EMU_FRAME_MAX		(64 * 1024)
+
+struct emu_control_event {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+};
+
+struct emu_ep0_io {
+	struct usb_raw_ep_io inner;
+	char data[EMU_EP0_MAX];
+};
+
+struct emu_ep_io {
+	struct usb_raw_ep_io inner;
+	char data[EMU_FRAME_MAX];
+};
+
+static struct {
+	int fd;
+	unsigned int pid;
+	unsigned int rate;
+	unsigned int size;
+	unsigned int contacts;
+	unsigned long long count;
+	const char *serial;
+	const char *driver;
+	const char *device;
+	int ep_in_addr;
+	int ep_out_addr;
+	int ep_in;
+	int ep_out;
+	int configured;
+	pthread_t in_thread;
+	pthread_t out_thread;
+} emu = {
+	.pid = 0x0001,
+	.rate = 100,
+	.size = 64,
+	.contacts = 2,
+	.serial = "EMU0000001",
+	.driver = "dummy_udc",
+	.device = "dummy_udc.0",
+	.ep_in_addr = -1,
+	.ep_out_addr = -1,
+};
+
+static struct usb_device_descriptor emu_device = {
+	.bLength =		USB_DT_DEVICE_SIZE,
+	.bDescriptorType =	USB_DT_DEVICE,
+	.bcdUSB =		0, /* filled in main() */
+	.bMaxPacketSize0 =	64,
+	.iManufacturer =	1,
+	.iProduct =		2,
+	.iSerialNumber =	3,
+	.bNumConfigurations =	1,
+};
+
+static struct {
+	struct usb_config_descriptor config;
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor ep_in;
+	struct usb_endpoint_descriptor ep_out;
+} __attribute__((packed)) emu_config;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void emu_build_descriptors(void)
+{
+	emu_device.bcdUSB = htole16(0x0200);
+	emu_device.idVendor = htole16(EMU_VENDOR_ID);
+	emu_device.idProduct = htole16(emu.pid);
+	emu_device.bcdDevice = htole16(0x0100);
+
+	emu_config.config.bLength = USB_DT_CONFIG_SIZE;
+	emu_config.config.bDescriptorType = USB_DT_CONFIG;
+	emu_config.config.wTotalLength = htole16(sizeof(emu_config));
+	emu_config.config.bNumInterfaces = 1;
+	emu_config.config.bConfigurationValue = 1;
+	emu_config.config.bmAttributes = USB_CONFIG_ATT_ONE;
+	emu_config.config.bMaxPower = 50;
+
+	/* the interface pqlabs_table matches */
+	emu_config.intf.bLength = USB_DT_INTERFACE_SIZE;
+	emu_config.intf.bDescriptorType = USB_DT_INTERFACE;
+	emu_config.intf.bNumEndpoints = 2;
+	emu_config.intf.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+
+	emu_config.ep_in.bLength = USB_DT_ENDPOINT_SIZE;
+	emu_config.ep_in.bDescriptorType = USB_DT_ENDPOINT;
+	emu_config.ep_in.bEndpointAddress = USB_DIR_IN | emu.ep_in_addr;
+	emu_config.ep_in.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	emu_config.ep_in.wMaxPacketSize = htole16(EMU_MAX_PACKET);
+
+	emu_config.ep_out.bLength = USB_DT_ENDPOINT_SIZE;
+	emu_config.ep_out.bDescriptorType = USB_DT_ENDPOINT;
+	emu_config.ep_out.bEndpointAddress = USB_DIR_OUT | emu.ep_out_addr;
+	emu_config.ep_out.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	emu_config.ep_out.wMaxPacketSize = htole16(EMU_MAX_PACKET);
+}
+
+/* pick bulk endpoints of the UDC, preferring 0x82 like the real frame */
+static void emu_pick_endpoints(void)
+{
+	struct usb_raw_eps_info info;
+	int i, n, addr;
+
+	memset(&info, 0, sizeof(info));
+	n = ioctl(emu.fd, USB_RAW_IOCTL_EPS_INFO, &info);
+	if (n < 0)
+		die("USB_RAW_IOCTL_EPS_INFO");
+
+	for (i = 0; i < n; i++) {
+		struct usb_raw_ep_info *ep = &info.eps[i];
+
+		if (!ep->caps.type_bulk)
+			continue;
+		if (ep->caps.dir_in && emu.ep_in_addr != 2) {
+			addr = ep->addr == USB_RAW_EP_ADDR_ANY ? 2 : (int)ep->addr;
+			if (emu.ep_in_addr < 0 || addr == 2)
+				emu.ep_in_addr = addr;
+		} else if (ep->caps.dir_out && emu.ep_out_addr < 0) {
+			addr = ep->addr == USB_RAW_EP_ADDR_ANY ? 1 : (int)ep->addr;
+			if (addr != emu.ep_in_addr)
+				emu.ep_out_addr = addr;
+		}
+	}
+	if (emu.ep_in_addr < 0 || emu.ep_out_addr < 0) {
+		fprintf(stderr, "pqlabs_emu: %s has no bulk endpoints\n", emu.driver);
+		exit(1);
+	}
+	emu_build_descriptors();
+}
+
+/* a USB string descriptor from ASCII */
+static int emu_string(int index, char *buf, int len)
+{
+	static const char *strings[] = { NULL, "PQLabs", "PQLabs Multi-Touch (emulated)" };
+	const char *s;
+	int i, n;
+
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		return 4;
+	}
+	if (index == 3)
+		s = emu.serial;
+	else if (index < 3)
+		s = strings[index];
+	else
+		return -1;
+
+	n = strlen(s);
+	if (2 + 2 * n > len)
+		n = (len - 2) / 2;
+	buf[0] = 2 + 2 * n;
+	buf[1] = USB_DT_STRING;
+	for (i = 0; i < n; i++) {
+		buf[2 + 2 * i] = s[i];
+		buf[3 + 2 * i] = 0;
+	}
+	return 2 + 2 * n;
+}
+
+/* contacts walk along a circle each, one of them lifts now and then */
+static size_t emu_fill_frame(struct pqlabs_emu_frame *f, unsigned long long n)
+{
+	unsigned int i, count = emu.contacts;
+	size_t len = sizeof(*f) + count * sizeof(f->contact[0]);
+
+	if (len > emu.size) {
+		count = (emu.size - sizeof(*f)) / sizeof(f->contact[0]);
+		len = sizeof(*f) + count * sizeof(f->contact[0]);
+	}
+	memset(f, 0, emu.size);
+	f->tag = PQLABS_EMU_TAG;
+	f->contacts = count;
+	f->counter = htole16(n & 0xffff);
+	for (i = 0; i < count; i++) {
+		unsigned int phase = (n + i * 97) % 1000;
+		unsigned int x = phase < 500 ? phase * 60 : (1000 - phase) * 60;
+		unsigned int y = (i + 1) * PQLABS_EMU_AXIS_MAX / (count + 1);
+
+		f->contact[i].id = i + 1 + ((n / 1000) % 2) * 16;
+		f->contact[i].down = !(i == count - 1 && phase >= 900);
+		f->contact[i].x = htole16(x);
+		f->contact[i].y = htole16(y);
+	}
+	f->sent_ns = htole64(now_ns());
+	return emu.size > len ? emu.size : len;
+}
+
+static void *emu_in_loop(void *arg)
+{
+	static struct emu_ep_io io;
+	struct pqlabs_emu_frame *f = (void *)io.data;
+	unsigned long long n;
+	struct timespec next;
+	long long period = emu.rate ? 1000000000LL / emu.rate : 0;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n = 0; !emu.count || n < emu.count; n++) {
+		if (period) {
+			next.tv_nsec += period;
+			while (next.tv_nsec >= 1000000000L) {
+				next.tv_nsec -= 1000000000L;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		io.inner.ep = emu.ep_in;
+		io.inner.flags = 0;
+		io.inner.length = emu_fill_frame(f, n);
+		if (ioctl(emu.fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0) {
+			if (errno == ESHUTDOWN || errno == EINPROGRESS)
+				break;
+			perror("USB_RAW_IOCTL_EP_WRITE");
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void *emu_out_loop(void *arg)
+{
+	static struct emu_ep_io io;
+
+	(void)arg;
+	for (;;) {
+		io.inner.ep = emu.ep_out;
+		io.inner.flags = 0;
+		io.inner.length = sizeof(io.data);
+		if (ioctl(emu.fd, USB_RAW_IOCTL_EP_READ, &io) < 0)
+			break;
+	}
+	return NULL;
+}
+
+static void emu_configure(void)
+{
+	if (emu.configured)
+		return;
+
+	emu.ep_in = ioctl(emu.fd, USB_RAW_IOCTL_EP_ENABLE, &emu_config.ep_in);
+	if (emu.ep_in < 0)
+		die("USB_RAW_IOCTL_EP_ENABLE in");
+	emu.ep_out = ioctl(emu.fd, USB_RAW_IOCTL_EP_ENABLE, &emu_config.ep_out);
+	if (emu.ep_out < 0)
+		die("USB_RAW_IOCTL_EP_ENABLE out");
+	ioctl(emu.fd, USB_RAW_IOCTL_VBUS_DRAW, emu_config.config.bMaxPower);
+	if (ioctl(emu.fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+		die("USB_RAW_IOCTL_CONFIGURE");
+
+	pthread_create(&emu.in_thread, NULL, emu_in_loop, NULL);
+	pthread_create(&emu.out_thread, NULL, emu_out_loop, NULL);
+	emu.configured = 1;
+}
+
+/* answer a setup packet. returns the data length, or -1 to stall */
+static int emu_control(const struct usb_ctrlrequest *ctrl, char *buf, int *in)
+{
+	int value = le16toh(ctrl->wValue);
+	int len = le16toh(ctrl->wLength);
+
+	*in = ctrl->bRequestType & USB_DIR_IN;
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		return 0;	/* vendor requests are accepted and ignored */
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case USB_DT_DEVICE:
+			memcpy(buf, &emu_device, sizeof(emu_device));
+			return sizeof(emu_device) < (size_t)len ? (int)sizeof(emu_device) : len;
+		case USB_DT_CONFIG:
+			memcpy(buf, &emu_config, sizeof(emu_config));
+			return sizeof(emu_config) < (size_t)len ? (int)sizeof(emu_config) : len;
+		case USB_DT_STRING:
+			value = emu_string(value & 0xff, buf, EMU_EP0_MAX);
+			return value < len ? value : len;
+		default:
+			return -1;
+		}
+	case USB_REQ_SET_CONFIGURATION:
+		emu_configure();
+		return 0;
+	case USB_REQ_GET_CONFIGURATION:
+		buf[0] = emu.configured;
+		return 1;
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_CLEAR_FEATURE:
+		return 0;
+	case USB_REQ_GET_INTERFACE:
+		buf[0] = 0;
+		return 1;
+	case USB_REQ_GET_STATUS:
+		buf[0] = 0;
+		buf[1] = 0;
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void emu_event_loop(void)
+{
+	struct emu_control_event event;
+	struct emu_ep0_io io;
+	int len, in;
+
+	for (;;) {
+		event.inner.type = 0;
+		event.inner.length = sizeof(event.ctrl);
+		if (ioctl(emu.fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+			die("USB_RAW_IOCTL_EVENT_FETCH");
+
+		if (event.inner.type == USB_RAW_EVENT_CONNECT) {
+			if (emu.ep_in_addr < 0)
+				emu_pick_endpoints();
+			continue;
+		}
+		if (event.inner.type != USB_RAW_EVENT_CONTROL)
+			continue;
+
+		len = emu_control(&event.ctrl, io.data, &in);
+		if (len < 0) {
+			ioctl(emu.fd, USB_RAW_IOCTL_EP0_STALL, 0);
+			continue;
+		}
+		io.inner.ep = 0;
+		io.inner.flags = 0;
+		io.inner.length = in ? len : le16toh(event.ctrl.wLength);
+		if (io.inner.length > sizeof(io.data))
+			io.inner.length = sizeof(io.data);
+		if (ioctl(emu.fd, in ? USB_RAW_IOCTL_EP0_WRITE : USB_RAW_IOCTL_EP0_READ,
+			  &io) < 0)
+			perror("ep0");
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: pqlabs_emu [-p pid] [-r frames/s] [-s bytes] [-c contacts]\n"
+		"                  [-n frames] [-S serial] [-d udc_driver] [-D udc_device]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct usb_raw_init init;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:r:s:c:n:S:d:D:")) != -1) {
+		switch (opt) {
+		case 'p':
+			emu.pid = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			emu.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			emu.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			emu.contacts = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			emu.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			emu.serial = optarg;
+			break;
+		case 'd':
+			emu.driver = optarg;
+			break;
+		case 'D':
+			emu.device = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (emu.size < sizeof(struct pqlabs_emu_frame) || emu.size > EMU_FRAME_MAX) {
+		fprintf(stderr, "pqlabs_emu: frame size must be %zu..%d\n",
+			sizeof(struct pqlabs_emu_frame), EMU_FRAME_MAX);
+		return 2;
+	}
+	if (emu.contacts > PQLABS_EMU_MAX_CONTACTS)
+		emu.contacts = PQLABS_EMU_MAX_CONTACTS;
+
+	emu.fd = open("/dev/raw-gadget", O_RDWR);
+	if (emu.fd < 0)
+		die("/dev/raw-gadget");
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, emu.driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, emu.device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(emu.fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		die("USB_RAW_IOCTL_INIT");
+	if (ioctl(emu.fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		die("USB_RAW_IOCTL_RUN");
+
+	emu_event_loop();
+	return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * pqlabs_emu.h - bulk-in frames produced by pqlabs_emu
+ *
+ * The wire format of a real frame is not documented, so the emulator
+ * sends its own: a fixed header, then up to PQLABS_EMU_MAX_CONTACTS
+ * contacts, padded with zeros to the configured frame size. All fields
+ * are little endian.
+ */
+#ifndef _PQLABS_EMU_H
+#define _PQLABS_EMU_H
+
+#include <linux/types.h>
+
+#define PQLABS_EMU_TAG                       0xA5
+#define PQLABS_EMU_MAX_CONTACTS              10
+#define PQLABS_EMU_AXIS_MAX                  32767
+
+struct pqlabs_emu_contact
+{
+  __u8 id;		/* stays the same while the contact is down */
+  __u8 down;		/* 0 once the contact was lifted */
+  __le16 x;		/* 0 .. PQLABS_EMU_AXIS_MAX */
+  __le16 y;
+} __attribute__((packed));
+
+struct pqlabs_emu_frame
+{
+  __u8 tag;		/* PQLABS_EMU_TAG */
+  __u8 contacts;	/* entries in contact[] */
+  __le16 counter;	/* frame number, wraps */
+  __le64 sent_ns;	/* CLOCK_MONOTONIC when handed to the UDC */
+  struct pqlabs_emu_contact contact[];
+} __attribute__((packed));
+
+#endif /* _PQLABS_EMU_H */
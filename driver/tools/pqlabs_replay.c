@@ -0,0 +1,125 @@
+/*
+ * pqlabs_replay - play a capture through /dev/pqlabs_replay
+ *
+ * Needs the driver loaded with replay=1. Readers of /dev/pqlabs_replay,
+ * pqmtpdaemon or a benchmark, then see the captured transfers as if a
+ * frame were attached.
+ *
+ *   pqlabs_replay [-s percent] [-l loops] capture.pqcap [device]
+ *
+ * -s 100 plays at the original speed, -s 0 as fast as the readers take
+ * the transfers. -l 0 loops forever.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usb_pqlabs.h"
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pqlabs_replay [-s percent] [-l loops] capture [device]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const struct pqlabs_capture_header *hdr;
+	const char *device = "/dev/pqlabs_replay";
+	int speed = 100, loops = 1, loop;
+	size_t off, size;
+	struct stat st;
+	char *map;
+	int in, out, opt;
+
+	while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+		usage();
+	if (argc - optind == 2)
+		device = argv[optind + 1];
+
+	in = open(argv[optind], O_RDONLY);
+	if (in < 0 || fstat(in, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	hdr = (const void *)map;
+	if (size < sizeof(*hdr) || hdr->magic != PQLABS_CAPTURE_MAGIC ||
+	    hdr->version != PQLABS_CAPTURE_VERSION ||
+	    hdr->header_size < sizeof(*hdr) || hdr->header_size > size) {
+		fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+		return 1;
+	}
+
+	/* write-only, so the player does not hold the ring back */
+	out = open(device, O_WRONLY);
+	if (out < 0) {
+		perror(device);
+		return 1;
+	}
+	if (ioctl(out, USB_IOCTL_REPLAY_SPEED, &speed) < 0) {
+		perror("USB_IOCTL_REPLAY_SPEED");
+		return 1;
+	}
+
+	for (loop = 0; !loops || loop < loops; loop++) {
+		for (off = hdr->header_size; off + sizeof(struct pqlabs_frame_header) <= size;) {
+			const struct pqlabs_frame_header *f = (const void *)(map + off);
+			size_t len = sizeof(*f) + f->length;
+
+			if (off + len > size)
+				break;
+			/* one record per write, the driver paces each */
+			if (write_all(out, f, len) < 0) {
+				perror("write");
+				return 1;
+			}
+			off += len;
+		}
+	}
+
+	close(out);
+	munmap(map, size);
+	close(in);
+	return 0;
+}
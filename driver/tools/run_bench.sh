@@ -0,0 +1,46 @@
+#!/bin/bash
+# build the driver and the tools, emulate a frame on dummy_hcd and
+# benchmark the read path. needs root, kernel headers and a kernel with
+# CONFIG_USB_DUMMY_HCD and CONFIG_USB_RAW_GADGET.
+#
+#   RATE=1000 SIZE=64 DURATION=10 PID=0x0001 ./run_bench.sh [pqlabs_bench options]
+#
+# extra module parameters for usb_pqlabs go in MODULE_PARAMS.
+
+set -e
+cd "$(dirname "$0")"
+
+RATE=${RATE:-1000}
+SIZE=${SIZE:-64}
+DURATION=${DURATION:-10}
+PID=${PID:-0x0001}
+
+make -s
+make -s -C ../src
+
+modprobe dummy_hcd
+modprobe raw_gadget
+if lsmod | grep -q '^usb_pqlabs'; then
+	rmmod usb_pqlabs
+fi
+insmod ../src/usb_pqlabs.ko $MODULE_PARAMS
+
+./pqlabs_emu -p "$PID" -r "$RATE" -s "$SIZE" &
+emu=$!
+trap 'kill $emu 2>/dev/null; wait $emu 2>/dev/null' EXIT
+
+# wait for the emulated frame to be bound
+dev=
+for i in $(seq 50); do
+	dev=$(ls /dev/pqlabs_bulk* /dev/usb/pqlabs_bulk* 2>/dev/null | head -n 1)
+	[ -n "$dev" ] && break
+	sleep 0.1
+done
+if [ -z "$dev" ]; then
+	echo "run_bench: no pqlabs_bulk device appeared" >&2
+	exit 1
+fi
+
+echo "rate $RATE"
+echo "size $SIZE"
+./pqlabs_bench -t "$DURATION" "$@" "$dev"
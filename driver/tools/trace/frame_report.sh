@@ -0,0 +1,41 @@
+#!/bin/bash
+# record the pqlabs tracepoints with perf and print one line per frame:
+#   minor seq bytes bus_us fifo_us
+# bus_us is submit -> complete, fifo_us is complete -> read().
+# usage: sudo ./frame_report.sh [seconds]
+
+SECONDS_TO_RECORD=${1:-10}
+DATA=$(mktemp /tmp/pqlabs-perf.XXXXXX)
+trap 'rm -f "$DATA"' EXIT
+
+perf record -q -a -o "$DATA" \
+	-e pqlabs:pqlabs_rx_complete \
+	-e pqlabs:pqlabs_copy_to_user \
+	-- sleep "$SECONDS_TO_RECORD" || exit 1
+
+perf script -i "$DATA" -F event,trace 2>/dev/null | awk '
+function field(name,    i, kv) {
+	for (i = 1; i <= NF; i++) {
+		split($i, kv, "=")
+		if (kv[1] == name)
+			return kv[2]
+	}
+	return ""
+}
+BEGIN { printf "%5s %10s %8s %10s %10s\n", "minor", "seq", "bytes", "bus_us", "fifo_us" }
+/pqlabs_rx_complete/ {
+	if (field("status") != 0)
+		next
+	key = field("minor") ":" field("seq")
+	bytes[key] = field("actual")
+	bus[key] = field("latency_ns") / 1000
+}
+/pqlabs_copy_to_user/ {
+	key = field("minor") ":" field("seq")
+	if (!(key in bus))
+		next
+	printf "%5d %10d %8d %10.1f %10.1f\n", field("minor"), field("seq"),
+	       bytes[key], bus[key], field("latency_ns") / 1000
+	delete bus[key]
+	delete bytes[key]
+}'